@@ -1,9 +1,29 @@
-from setuptools import setup, find_packages, Extension
+from setuptools import setup, find_packages, Extension, Command
 from setuptools.command.build_ext import build_ext
 
 with open('README.rst', encoding='utf8') as f:
     long_description = f.read()
 
+
+class bench(Command):
+    description = 'build the extension in place and run xtimeout/tests/bench_monitor.py'
+    user_options = [('quick', None, 'fewer loops and samples')]
+    boolean_options = ['quick']
+
+    def initialize_options(self):
+        self.quick = False
+
+    def finalize_options(self):
+        pass
+
+    def run(self):
+        build = self.reinitialize_command('build_ext')
+        build.inplace = True
+        self.run_command('build_ext')
+        from xtimeout.tests import bench_monitor
+        bench_monitor.main(['--quick'] if self.quick else [])
+
+
 setup(
     name='xtimeout',
     version='0.3.2',
@@ -16,9 +36,13 @@ setup(
     license='MIT',
     packages=find_packages('.'),
     ext_modules=[
-        Extension('_xtimeout', ['xtimeout/_xtimeout.cpp'])
+        Extension('_xtimeout', ['xtimeout/_xtimeout.cpp'],
+                  depends=['xtimeout/xtimeout_capi.h'])
     ],
+    # for extensions using the C API
+    package_data={'xtimeout': ['xtimeout_capi.h']},
     #test_suite='xtimeout.tests',
+    cmdclass={'bench': bench},
     classifiers=[
         'License :: OSI Approved :: MIT License',
         'Programming Language :: C++',
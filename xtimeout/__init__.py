@@ -1,31 +1,276 @@
-import functools
-
-from _xtimeout import Injector
-
-__version__ = "0.3.2"
-__all__ = ["check_context", "check_time", "Injector"]
-
-
-class check_context(object):
-    def __init__(self, timeout, callback):
-        self._injector = Injector(timeout, callback)
-
-    def __enter__(self):
-        self._injector.start()
-        return self
-
-    def __exit__(self, exc_type, exc_value, tb):
-        self._injector.stop()
-
-    def reset(self):
-        self._injector.reset()
-
-
-def check_time(timeout, callback):
-    def decorate(func):
-        @functools.wraps(func)
-        def wrapper(*args, **kwargs):
-            with check_context(timeout, callback):
-                return func(*args, **kwargs)
-        return wrapper
-    return decorate
+import asyncio
+import functools
+import threading
+import weakref
+
+from _xtimeout import (Injector, deadline, drain, now, remaining, set_checkers,
+                       set_clock, snapshot, stats)
+
+__version__ = "0.3.2"
+__all__ = ["check_context", "check_time", "capture_context", "capture_time",
+           "drain", "snapshot", "merge", "quantile", "stats",
+           "set_checkers", "set_clock", "remaining", "deadline", "now", "propagate",
+           "Injector"]
+
+
+_current_task = getattr(asyncio, "current_task", None) or asyncio.Task.current_task
+# 3.6 has no get_running_loop, get_event_loop returns the running one there
+_get_running_loop = getattr(asyncio, "get_running_loop", None) or asyncio.get_event_loop
+_loop_sinks = weakref.WeakKeyDictionary()
+
+
+def _run_expired(expired):
+    for callback, start_time in expired:
+        callback(start_time)
+
+
+class _LoopSink(object):
+    # called from the delivery thread with the expired deadlines of one loop,
+    # the whole batch costs a single loop wakeup
+    def __init__(self, loop):
+        self._loop = weakref.ref(loop)
+
+    def __call__(self, expired):
+        loop = self._loop()
+        if loop is None:
+            return
+        try:
+            loop.call_soon_threadsafe(_run_expired, expired)
+        except RuntimeError:
+            # the loop is closed
+            pass
+
+
+def _get_sink(loop):
+    try:
+        sink = _loop_sinks.get(loop)
+        if sink is None:
+            sink = _loop_sinks[loop] = _LoopSink(loop)
+    except TypeError:
+        # the loop doesn't support weak references
+        sink = _LoopSink(loop)
+    return sink
+
+
+class _TaskDeadline(object):
+    # runs on the loop, the callback sees the task it was armed for and if
+    # it raises, the task is cancelled and the error comes out of the guard
+    __slots__ = ("task", "callback", "error")
+
+    def __init__(self, task, callback):
+        self.task = task
+        self.callback = callback
+        self.error = None
+
+    def __call__(self, start_time):
+        task = self.task
+        if task is None or task.done():
+            return
+        try:
+            self.callback(start_time)
+        except Exception as e:
+            self.error = e
+            task.cancel()
+
+
+def _raiser(exception):
+    def raise_exception(start_time):
+        raise exception
+    return raise_exception
+
+
+class _task_context(object):
+    # a hard deadline cancels the task with exception, whatever the callback did
+    def __init__(self, timeout, callback, site=None, watchdog=False, hard=None,
+                 exception=TimeoutError):
+        self._timeout = timeout
+        self._callback = callback
+        self._site = site
+        self._watchdog = watchdog
+        self._hard = hard
+        self._exception = exception
+        self._deadlines = []
+        self._injectors = []
+
+    async def __aenter__(self):
+        task = _current_task()
+        if task is None:
+            raise RuntimeError("async check_context must be used inside a task")
+        sink = _get_sink(_get_running_loop())
+        self._deadlines = []
+        self._injectors = []
+        if self._callback is not None:
+            deadline = _TaskDeadline(task, self._callback)
+            self._deadlines.append(deadline)
+            self._injectors.append(Injector(self._timeout, deadline, sink,
+                                            site=self._site, watchdog=self._watchdog))
+        if self._hard is not None:
+            deadline = _TaskDeadline(task, _raiser(self._exception))
+            self._deadlines.append(deadline)
+            self._injectors.append(Injector(self._hard, deadline, sink, watchdog=self._watchdog))
+        for injector in self._injectors:
+            injector.start()
+        return self
+
+    async def __aexit__(self, exc_type, exc_value, tb):
+        for injector in self._injectors:
+            injector.stop()
+        deadlines, self._deadlines = self._deadlines, []
+        errors = [deadline.error for deadline in deadlines if deadline.error is not None]
+        task = deadlines[0].task
+        for deadline in deadlines:
+            deadline.task = None
+        if errors and exc_type is asyncio.CancelledError:
+            uncancel = getattr(task, "uncancel", None)
+            if uncancel is not None:
+                uncancel()
+            # the hard one comes later and wins
+            raise errors[-1]
+
+    def reset(self):
+        if not self._deadlines:
+            return False
+        for injector in self._injectors:
+            injector.reset()
+        return True
+
+
+class check_context(object):
+    # with a site the elapsed time of every use is recorded for it, see snapshot().
+    # a watchdog is meant to be reset() as a heartbeat, which only moves its deadline.
+    # past hard milliseconds exception is raised in the thread, whatever the
+    # callback did, under `async with` the task is cancelled with it instead.
+    # with inherit it ends no later than the guards around it on the thread,
+    # a task doesn't own its thread so that can't be used under `async with`
+    def __init__(self, timeout, callback, site=None, watchdog=False, hard=None,
+                 exception=TimeoutError, inherit=False):
+        self._injector = Injector(timeout, callback, site=site, watchdog=watchdog,
+                                  hard=hard, exception=exception, inherit=inherit)
+        self._task_context = _task_context(timeout, callback, site, watchdog, hard, exception)
+        self._inherit = inherit
+
+    def __enter__(self):
+        self._injector.start()
+        return self
+
+    def __exit__(self, exc_type, exc_value, tb):
+        self._injector.stop()
+
+    # under `async with` the deadline belongs to the current task
+    async def __aenter__(self):
+        if self._inherit:
+            raise TypeError("inherit can't be used under async with")
+        await self._task_context.__aenter__()
+        return self
+
+    async def __aexit__(self, exc_type, exc_value, tb):
+        await self._task_context.__aexit__(exc_type, exc_value, tb)
+
+    def reset(self):
+        if not self._task_context.reset():
+            self._injector.reset()
+
+
+def check_time(timeout, callback, histogram=False):
+    def decorate(func):
+        # the code object is the site of the recorded elapsed times
+        site = getattr(func, "__code__", func) if histogram else None
+        if asyncio.iscoroutinefunction(func):
+            @functools.wraps(func)
+            async def async_wrapper(*args, **kwargs):
+                async with _task_context(timeout, callback, site):
+                    return await func(*args, **kwargs)
+            return async_wrapper
+
+        # injectors are bound to the thread creating them, keep the idle
+        # ones per thread and re-arm them instead of allocating per call
+        local = threading.local()
+
+        @functools.wraps(func)
+        def wrapper(*args, **kwargs):
+            try:
+                idle = local.idle
+            except AttributeError:
+                idle = local.idle = []
+            injector = idle.pop() if idle else Injector(timeout, callback, site=site)
+            try:
+                with injector:
+                    return func(*args, **kwargs)
+            finally:
+                idle.append(injector)
+        return wrapper
+    return decorate
+
+
+def propagate(func, callback):
+    """Carry the budget of the calling thread over to the thread running func,
+    e.g. executor.submit(propagate(work, on_timeout)). func runs under a guard
+    for the time that is left, so remaining() works there as well."""
+    end = deadline()
+    if end is None:
+        return func
+
+    @functools.wraps(func)
+    def wrapper(*args, **kwargs):
+        with check_context(max((end - now()) * 1000, 0.0), callback):
+            return func(*args, **kwargs)
+    return wrapper
+
+
+def merge(*snapshots):
+    """Add up snapshots, e.g. the ones taken with reset=True over time."""
+    merged = {}
+    for snap in snapshots:
+        for site, buckets in snap.items():
+            counts = merged.setdefault(site, {})
+            for lower, count in buckets:
+                counts[lower] = counts.get(lower, 0) + count
+    return {site: sorted(counts.items()) for site, counts in merged.items()}
+
+
+def quantile(buckets, q):
+    """Lower bound in nanoseconds of the bucket holding the q quantile of a
+    snapshot entry, q from 0 to 1, e.g. 0.99 for p99."""
+    total = sum(count for lower, count in buckets)
+    seen = 0
+    for lower, count in buckets:
+        seen += count
+        if seen >= q * total:
+            return lower
+    return buckets[-1][0] if buckets else 0
+
+
+class capture_context(object):
+    """Record the stack of the thread in place of a callback when it runs past
+    the timeout, read them with drain(). Nothing runs on the thread itself."""
+    def __init__(self, timeout, tag=None):
+        self._injector = Injector(timeout, tag, capture=True)
+
+    def __enter__(self):
+        self._injector.start()
+        return self
+
+    def __exit__(self, exc_type, exc_value, tb):
+        self._injector.stop()
+
+
+def capture_time(timeout):
+    def decorate(func):
+        # the code object tells where a record comes from
+        tag = getattr(func, "__code__", func)
+        local = threading.local()
+
+        @functools.wraps(func)
+        def wrapper(*args, **kwargs):
+            try:
+                idle = local.idle
+            except AttributeError:
+                idle = local.idle = []
+            injector = idle.pop() if idle else Injector(timeout, tag, capture=True)
+            try:
+                with injector:
+                    return func(*args, **kwargs)
+            finally:
+                idle.append(injector)
+        return wrapper
+    return decorate
@@ -1,20 +1,35 @@
 #define NOMINMAX
-#define Py_BUILD_CORE_MODULE
 #include <Python.h>
 #include <pythread.h>
 #include <pystate.h>
 #include <frameobject.h>
 
-#if (PY_MINOR_VERSION == 8)
-#include <internal/pycore_pystate.h>
-#elif (PY_MINOR_VERSION >= 9)
-#include <internal/pycore_interp.h>
+#include "xtimeout_capi.h"
+
+#if (PY_VERSION_HEX >= 0x030C0000)
+// deliver into non-main threads through a sys.monitoring tool instead of PyEval_SetTrace
+#define USE_SYS_MONITORING
+#endif
+
+#if (PY_VERSION_HEX >= 0x03090000) && (PY_VERSION_HEX < 0x030D0000)
+// a pending call added from a thread other than the main one doesn't trip
+// the eval breaker until the main thread takes the GIL again
+#define PENDING_CALL_NEEDS_SIGNAL
+// exported without a public header, what the signal handler of Python calls.
+// it trips the eval breaker if called on the main thread, from any thread on
+// Windows, the main thread runs the pending calls along with the signals
+extern "C" PyAPI_FUNC(void) _PyEval_SignalReceived(PyInterpreterState* interp);
 #endif
 
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
 #include <chrono>
+#include <cstring>
 #include <functional>
+#include <iterator>
 #include <memory>
+#include <new>
 #include <queue>
 #include <unordered_map>
 #include <vector>
@@ -24,45 +39,70 @@
 #include <thread>
 #include <mutex>
 
-#include <climits>
 #include <time.h>
+#include <errno.h>
 
 #ifdef _WIN32
 #include <windows.h>
 #include <mmsystem.h>
 #pragma comment(lib, "Winmm.lib")
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
 #endif // _WIN32
 
-typedef std::chrono::steady_clock ClockType;
-static const auto INTERVAL_RESOLUTION = std::chrono::milliseconds(5);
+#ifdef __linux__
+// the checker waits on a timerfd and an eventfd through epoll
+#define USE_TIMERFD
+#include <sys/prctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#ifdef CLOCK_MONOTONIC_COARSE
+#define USE_COARSE_CLOCK
+#endif
+#endif // __linux__
 
-static int g_PyTLSKey = -1;
-static long g_MainThreadId;
+#ifndef _WIN32
+// the child of a fork gets its timers reset and its threads started again,
+// see BeforeFork
+#define USE_ATFORK
+#include <pthread.h>
+#include <signal.h>
+#endif // _WIN32
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+// start times can be taken from the invariant TSC, see set_clock()
+#define USE_TSC
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#endif
 
-static void AccurateSleep(unsigned long nMilliseconds)
-{
+typedef std::chrono::steady_clock ClockType;
+// interval to retry a pending call when the interpreter's ring is full
+static const auto PENDING_RETRY_INTERVAL = std::chrono::milliseconds(1);
+// the checker finishes waiting for a deadline with CPreciseTimer from this close,
+// a deadline armed meanwhile can be late by up to this much
 #ifdef _WIN32
-    // must call timeBeginPeriod(1) first
-    Sleep(nMilliseconds);
+static const auto PRECISE_WAIT_WINDOW = std::chrono::milliseconds(2);
 #else
-    timespec req, rem;
-    req.tv_sec = 0;
-    req.tv_nsec = nMilliseconds * 1000000;
-    rem.tv_sec = 0;
-    rem.tv_nsec = 0;
-    while (nanosleep(&req, &rem) == 0)
-    {
-        if (rem.tv_nsec < 1000)
-        {
-            break;
-        }
-        req = rem;
-        rem.tv_nsec = 0;
-        rem.tv_sec = 0;
-    }
+static const auto PRECISE_WAIT_WINDOW = std::chrono::microseconds(100);
 #endif // _WIN32
-}
+// longest timeout accepted, in milliseconds, keeps the deadlines far from overflowing
+static const double MAX_TIMEOUT_MS = 1e12;
+// compact the timer heap when cancelled entries may take up more than a half of it
+static const size_t MIN_COMPACT_SIZE = 64;
+// upper bound of set_checkers()
+static const uint32_t MAX_CHECKERS = 64;
+// checker threads that new threads are spread over, see CContextHelper::For
+static std::atomic<uint32_t> g_CheckerCount(1);
+
+static long g_MainThreadId;
 
 
 static inline long GetCurThreadId()
@@ -75,31 +115,330 @@ static inline long GetCurThreadId()
 
 }
 
+// the current thread state, null without one instead of a fatal error
+static inline PyThreadState* GetThreadStateUnchecked()
+{
+#if (PY_VERSION_HEX >= 0x030D0000)
+    return PyThreadState_GetUnchecked();
+#else
+    return _PyThreadState_UncheckedGet();
+#endif
+}
+
+static inline PyInterpreterState* GetInterpreter(PyThreadState* state)
+{
+#if (PY_VERSION_HEX >= 0x03090000)
+    return PyThreadState_GetInterpreter(state);
+#else
+    return state->interp;
+#endif
+}
+
+static PyInterpreterState* GetMainInterpreter()
+{
+#if (PY_VERSION_HEX >= 0x03070000)
+    return PyInterpreterState_Main();
+#else
+    // new interpreters are linked at the head, the main one is the last
+    PyInterpreterState* interp = PyInterpreterState_Head();
+    while (PyInterpreterState_Next(interp) != nullptr)
+    {
+        interp = PyInterpreterState_Next(interp);
+    }
+    return interp;
+#endif
+}
+
+// source of the start times taken on every arming, the checker and the
+// rest keep ClockType. all of them count on its epoch, see set_clock()
+class CArmClock
+{
+public:
+    using TimePoint = std::chrono::time_point<ClockType>;
+
+    enum Kind
+    {
+        STEADY,
+        COARSE,
+        TSC,
+    };
+
+    static CArmClock& Instance()
+    {
+        static CArmClock clock;
+        return clock;
+    }
+
+    TimePoint Now() const
+    {
+        switch (m_Kind.load(std::memory_order_acquire))
+        {
+#ifdef USE_COARSE_CLOCK
+        case COARSE:
+            return NowCoarse();
+#endif
+#ifdef USE_TSC
+        case TSC:
+            return NowTSC();
+#endif
+        default:
+            return ClockType::now();
+        }
+    }
+
+    Kind GetKind() const
+    {
+        return m_Kind.load(std::memory_order_relaxed);
+    }
+
+    // false if the kind isn't available on this machine
+    bool SetKind(Kind kind)
+    {
+        std::lock_guard<std::mutex> lock(m_Mtx);
+        if (kind == COARSE && !InitCoarse())
+        {
+            return false;
+        }
+        if (kind == TSC && !InitTSC())
+        {
+            return false;
+        }
+        m_Kind.store(kind, std::memory_order_release);
+        return true;
+    }
+
+private:
+    CArmClock() : m_Kind(STEADY), m_CoarseRes(0), m_NsPerTick(0), m_RefreshTicks(0)
+    {
+    }
+
+    bool InitCoarse()
+    {
+#ifdef USE_COARSE_CLOCK
+        // the same epoch as the steady clock of libstdc++ and libc++ there
+        struct timespec res;
+        if (m_CoarseRes.count() == 0 && clock_getres(CLOCK_MONOTONIC_COARSE, &res) == 0)
+        {
+            m_CoarseRes = std::chrono::seconds(res.tv_sec) + std::chrono::nanoseconds(res.tv_nsec);
+        }
+        return m_CoarseRes.count() != 0;
+#else
+        return false;
+#endif
+    }
+
+#ifdef USE_COARSE_CLOCK
+    // the coarse clock lags by up to a tick, pushed forward by one so a
+    // deadline comes late rather than early
+    TimePoint NowCoarse() const
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return TimePoint(std::chrono::duration_cast<ClockType::duration>(
+            std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec) + m_CoarseRes));
+    }
+#endif
+
+    bool InitTSC()
+    {
+#ifdef USE_TSC
+        if (m_NsPerTick != 0)
+        {
+            return true;
+        }
+        // invariant TSC, it ticks at a constant rate in sync across cores
+        unsigned int regs[4] = { 0 };
+#ifdef _MSC_VER
+        __cpuid(reinterpret_cast<int*>(regs), 0x80000000);
+        if (regs[0] < 0x80000007)
+        {
+            return false;
+        }
+        __cpuid(reinterpret_cast<int*>(regs), 0x80000007);
+#else
+        if (__get_cpuid_max(0x80000000, nullptr) < 0x80000007)
+        {
+            return false;
+        }
+        __get_cpuid(0x80000007, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+        if (!(regs[3] & (1 << 8)))
+        {
+            return false;
+        }
+        uint64_t startTick;
+        auto start = ReadPair(startTick);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        uint64_t endTick;
+        auto end = ReadPair(endTick);
+        if (endTick <= startTick)
+        {
+            return false;
+        }
+        m_NsPerTick = std::chrono::duration<double, std::nano>(end - start).count() / (endTick - startTick);
+        m_RefreshTicks = static_cast<uint64_t>(1e9 / m_NsPerTick);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+#ifdef USE_TSC
+    // a steady time and the tick in the middle of reading it
+    static TimePoint ReadPair(uint64_t& tick)
+    {
+        uint64_t before = __rdtsc();
+        auto now = ClockType::now();
+        tick = before + (__rdtsc() - before) / 2;
+        return now;
+    }
+
+    // ticks are scaled from a steady time taken on this thread, it's taken
+    // again every second so the calibration error can't add up
+    TimePoint NowTSC() const
+    {
+        static thread_local uint64_t anchorTick = 0;
+        static thread_local TimePoint anchorTime;
+        uint64_t delta = __rdtsc() - anchorTick;
+        if (anchorTick == 0 || delta > m_RefreshTicks)
+        {
+            anchorTime = ReadPair(anchorTick);
+            return anchorTime;
+        }
+        return anchorTime + std::chrono::duration_cast<ClockType::duration>(
+            std::chrono::duration<double, std::nano>(delta * m_NsPerTick));
+    }
+#endif
+
+    std::mutex m_Mtx;
+    std::atomic<Kind> m_Kind;
+    std::chrono::nanoseconds m_CoarseRes;
+    double m_NsPerTick;
+    uint64_t m_RefreshTicks;
+};
+
 static PyObject* TimePointToPyFloat(const std::chrono::time_point<ClockType>& time)
 {
-    auto startNs = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch());
-    double pyTime = _PyTime_AsSecondsDouble(startNs.count());
+    double pyTime = std::chrono::duration<double>(time.time_since_epoch()).count();
     return PyFloat_FromDouble(pyTime);
 }
 
+// call with a single argument from the stack, no format parsing or argument tuple
+static PyObject* CallOneArg(PyObject* callable, PyObject* arg)
+{
+    // the slot before the argument may be used by the callee, e.g. for a bound method
+    PyObject* args[2] = { nullptr, arg };
+#if (PY_VERSION_HEX >= 0x03090000)
+    return PyObject_Vectorcall(callable, args + 1, 1 | PY_VECTORCALL_ARGUMENTS_OFFSET, nullptr);
+#elif (PY_VERSION_HEX >= 0x03080000)
+    return _PyObject_Vectorcall(callable, args + 1, 1 | PY_VECTORCALL_ARGUMENTS_OFFSET, nullptr);
+#else
+    return _PyObject_FastCall(callable, args + 1, 1);
+#endif
+}
+
+#ifdef WITH_THREAD
+// the TLS key Python keeps the GIL state of a thread in, it isn't exposed.
+// keys are handed out lowest first and that one is older than any key made
+// now, so only the ones below a fresh key are tried. a key holding what
+// PyGILState_GetThisThreadState() returns is taken once writing it changes
+// that too. looked up on a swap until it's found
+#if (PY_VERSION_HEX >= 0x03070000)
+static bool IsGILStateKey(Py_tss_t* key, PyThreadState* state)
+{
+    // the marker is never dereferenced, it's only compared with
+    int marker;
+    if (PyThread_tss_set(key, &marker) != 0)
+    {
+        return false;
+    }
+    bool isKey = PyGILState_GetThisThreadState() == reinterpret_cast<PyThreadState*>(&marker);
+    PyThread_tss_set(key, state);
+    return isKey;
+}
+
+// null if not found
+static Py_tss_t* GetGILStateKey()
+{
+    static Py_tss_t key = Py_tss_NEEDS_INIT;
+    static std::atomic<bool> isFound(false);
+    if (isFound.load(std::memory_order_acquire))
+    {
+        return &key;
+    }
+    PyThreadState* state = PyGILState_GetThisThreadState();
+    Py_tss_t probe = Py_tss_NEEDS_INIT;
+    if (state == nullptr || PyThread_tss_create(&probe) != 0)
+    {
+        return nullptr;
+    }
+    auto end = probe._key;
+    PyThread_tss_delete(&probe);
+    for (decltype(end) i = 0; i < end; ++i)
+    {
+        Py_tss_t candidate = Py_tss_NEEDS_INIT;
+        candidate._is_initialized = 1;
+        candidate._key = i;
+        if (PyThread_tss_get(&candidate) == state && IsGILStateKey(&candidate, state))
+        {
+            key = candidate;
+            isFound.store(true, std::memory_order_release);
+            return &key;
+        }
+    }
+    return nullptr;
+}
+#else
+// -1 if not found
+static int GetGILStateKey()
+{
+    static std::atomic<int> key(-1);
+    if (key.load(std::memory_order_relaxed) != -1)
+    {
+        return key.load(std::memory_order_relaxed);
+    }
+    PyThreadState* state = PyGILState_GetThisThreadState();
+    int probe = PyThread_create_key();
+    if (state == nullptr || probe == -1)
+    {
+        return -1;
+    }
+    PyThread_delete_key(probe);
+    for (int i = 0; i < probe; ++i)
+    {
+        if (PyThread_get_key_value(i) == state)
+        {
+            key.store(i, std::memory_order_relaxed);
+            return i;
+        }
+    }
+    return -1;
+}
+#endif
+#endif // WITH_THREAD
+
+// the thread state of a thread in one interpreter, kept by its CThreadDelivery
 class CThreadState
 {
 public:
-    CThreadState(PyThreadState* state)
-        : m_State(state), m_PrevState(nullptr)
+    CThreadState(PyThreadState* state, bool isMainThread)
+        : m_State(state), m_PrevState(nullptr), m_PrevGILState(nullptr), m_IsMainThread(isMainThread)
     {
-        m_IsMainThread = g_MainThreadId == GetCurThreadId();
     }
 
     void SwapState()
     {
-        if (PyThreadState_GET() == m_State)
+        PyThreadState* state = GetState();
+        if (PyThreadState_GET() == state)
         {
             return;
         }
-        PyThread_set_key_value(g_PyTLSKey, m_State);
-        m_PrevState = PyThreadState_Swap(m_State);
-        assert(PyThreadState_GET() == m_State);
+        // the GIL state follows, so PyGILState_Check() and the debug check
+        // of PyThreadState_Swap agree with the swapped in state
+        m_PrevGILState = PyGILState_GetThisThreadState();
+        SetGILState(state);
+        m_PrevState = PyThreadState_Swap(state);
+        assert(PyThreadState_GET() == state);
     }
 
     void RestoreState()
@@ -108,7 +447,7 @@ public:
         {
             return;
         }
-        PyThread_set_key_value(g_PyTLSKey, m_PrevState);
+        SetGILState(m_PrevGILState);
         PyThreadState_Swap(m_PrevState);
         assert(PyThreadState_GET() == m_PrevState);
         m_PrevState = nullptr;
@@ -119,10 +458,45 @@ public:
         return m_IsMainThread;
     }
 
+    PyThreadState* GetState() const
+    {
+        return m_State.load(std::memory_order_relaxed);
+    }
+
+    // the thread has a new one in the same interpreter, e.g. another
+    // PyGILState_Ensure after the last one was released. on the thread itself
+    void SetState(PyThreadState* state)
+    {
+        if (state != nullptr && GetState() != state)
+        {
+            m_State.store(state, std::memory_order_relaxed);
+        }
+    }
+
 private:
-    PyThreadState* m_State;
+    static void SetGILState(PyThreadState* state)
+    {
+#ifdef WITH_THREAD
+#if (PY_VERSION_HEX >= 0x03070000)
+        Py_tss_t* key = GetGILStateKey();
+        if (key != nullptr)
+        {
+            PyThread_tss_set(key, state);
+        }
+#else
+        int key = GetGILStateKey();
+        if (key != -1)
+        {
+            PyThread_set_key_value(key, state);
+        }
+#endif
+#endif // WITH_THREAD
+    }
+
+    std::atomic<PyThreadState*> m_State;
     PyThreadState* m_PrevState;
-    bool m_IsMainThread;
+    PyThreadState* m_PrevGILState;
+    const bool m_IsMainThread;
 };
 
 #ifdef WITH_THREAD
@@ -233,561 +607,4106 @@ private:
 };
 
 
-class CLocalInjector
+// fixed-size block pool owned by one thread, blocks are carved from
+// contiguous slabs and reused by the owner without taking the malloc lock,
+// blocks freed on other threads are handed back through a lock-free stack
+class CSlabPool
 {
 private:
-    using TimePoint = std::chrono::time_point<ClockType>;
-
-    class CFastArgWrapper
+    struct CBlock
     {
-    public:
-        CFastArgWrapper(const std::shared_ptr<CLocalInjector>& obj)
-            : injector(obj)
-        {
-        }
-
-        std::shared_ptr<CLocalInjector> injector;
+        CSlabPool* owner;
+        CBlock* next;
     };
 
+    static const size_t SLAB_BLOCKS = 64;
+    static const size_t HEADER_SIZE = (sizeof(CBlock) + alignof(std::max_align_t) - 1)
+        / alignof(std::max_align_t) * alignof(std::max_align_t);
 
-    class CArgWrapper : public CFastArgWrapper
+    explicit CSlabPool(size_t objectSize)
+        : m_BlockSize(HEADER_SIZE + (objectSize + alignof(std::max_align_t) - 1)
+            / alignof(std::max_align_t) * alignof(std::max_align_t)),
+        m_FreeList(nullptr), m_RemoteFree(nullptr), m_Allocated(0), m_Balance(0)
     {
-    private:
-        CArgWrapper(const std::shared_ptr<CLocalInjector>& obj)
-            : CFastArgWrapper(obj), tracefunc(nullptr)
-        {
-        }
-
-    public:
-        Py_tracefunc tracefunc;
-        CPyObjectHolder pyTraceobj;
+    }
 
-        static CArgWrapper* Create(const std::shared_ptr<CLocalInjector>& obj)
+    ~CSlabPool()
+    {
+        for (auto slab : m_Slabs)
         {
-            return new CArgWrapper(obj);
+            ::operator delete(slab);
         }
+    }
 
-        static CArgWrapper* RestoreFromCapsule(PyObject* obj)
+    // the pool of the thread, null if it has none. trivially initialized, so
+    // reading it on the free path neither creates nor touches a pool
+    template <typename T>
+    static CSlabPool*& Current()
+    {
+        static thread_local CSlabPool* pool = nullptr;
+        return pool;
+    }
+
+    // drop the owner reference when the thread exits, the pool lives on
+    // until the last block which is still in use goes back
+    class COwner
+    {
+    public:
+        COwner(size_t objectSize, CSlabPool*& current) : m_Current(current)
         {
-            return static_cast<CArgWrapper*>(PyCapsule_GetPointer(obj, "ArgWrapper"));
+            m_Current = new CSlabPool(objectSize);
         }
 
-        CPyObjectHolder CreateCapsule()
+        ~COwner()
         {
-            return PyCapsule_New(this, "ArgWrapper", OnReleaseCapsule);
+            CSlabPool* pool = m_Current;
+            // frees from here on take the remote path
+            m_Current = nullptr;
+            pool->Orphan();
         }
 
     private:
-        static void OnReleaseCapsule(PyObject* obj)
-        {
-            auto _this = static_cast<CArgWrapper*>(
-                PyCapsule_GetPointer(obj, "ArgWrapper"));
-            delete _this;
-        }
+        CSlabPool*& m_Current;
     };
 
 public:
-    CLocalInjector() : m_IsValid(true), m_Callback(nullptr),
-        m_ThState(PyThreadState_GET())
+    template <typename T>
+    static void* Allocate()
     {
+        CSlabPool* pool = Current<T>();
+        if (pool == nullptr)
+        {
+            static thread_local COwner owner(sizeof(T), Current<T>());
+            pool = Current<T>();
+            if (pool == nullptr)
+            {
+                // the thread is exiting and its pool is already orphaned,
+                // the block gets a pool of its own
+                pool = new CSlabPool(sizeof(T));
+                void* ptr = pool->Allocate();
+                pool->Orphan();
+                return ptr;
+            }
+        }
+        return pool->Allocate();
     }
 
-    ~CLocalInjector()
+    template <typename T>
+    static void Free(void* ptr)
     {
-        assert(!m_IsValid);
+        if (ptr == nullptr)
+        {
+            return;
+        }
+        auto block = reinterpret_cast<CBlock*>(static_cast<char*>(ptr) - HEADER_SIZE);
+        CSlabPool* owner = block->owner;
+        if (owner == Current<T>())
+        {
+            block->next = owner->m_FreeList;
+            owner->m_FreeList = block;
+            owner->m_Allocated--;
+            return;
+        }
+        CBlock* head = owner->m_RemoteFree.load(std::memory_order_relaxed);
+        do
+        {
+            block->next = head;
+        } while (!owner->m_RemoteFree.compare_exchange_weak(
+            head, block, std::memory_order_release, std::memory_order_relaxed));
+        // only hits one once the owner thread is gone, see Orphan
+        if (owner->m_Balance.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            delete owner;
+        }
     }
 
-    PyObject* GetCallback() const
+private:
+    void* Allocate()
     {
-        return m_Callback;
+        if (m_FreeList == nullptr)
+        {
+            m_FreeList = m_RemoteFree.exchange(nullptr, std::memory_order_acquire);
+        }
+        if (m_FreeList == nullptr)
+        {
+            AddSlab();
+        }
+        CBlock* block = m_FreeList;
+        m_FreeList = block->next;
+        m_Allocated++;
+        return reinterpret_cast<char*>(block) + HEADER_SIZE;
     }
 
-    void SetCallback(PyObject* func)
+    void AddSlab()
     {
-        Py_XSETREF(m_Callback, func);
-        Py_INCREF(func);
+        char* slab = static_cast<char*>(::operator new(m_BlockSize * SLAB_BLOCKS));
+        m_Slabs.push_back(slab);
+        for (size_t i = SLAB_BLOCKS; i > 0; i--)
+        {
+            auto block = reinterpret_cast<CBlock*>(slab + m_BlockSize * (i - 1));
+            block->owner = this;
+            block->next = m_FreeList;
+            m_FreeList = block;
+        }
     }
 
-    void SetDuration(uint32_t nMilliSec)
+    // the balance goes below zero with every remote free, the owner thread
+    // adds what it counted on exit and leaves the blocks still in use
+    void Orphan()
     {
-        m_Duration = std::chrono::milliseconds(nMilliSec);
+        auto allocated = static_cast<int64_t>(m_Allocated);
+        if (m_Balance.fetch_add(allocated, std::memory_order_acq_rel) + allocated == 0)
+        {
+            delete this;
+        }
     }
 
-    void SetDuration(std::chrono::milliseconds millisec)
-    {
-        m_Duration = millisec;
+    const size_t m_BlockSize;
+    CBlock* m_FreeList;
+    std::atomic<CBlock*> m_RemoteFree;
+    // blocks taken minus the ones freed on the owner thread, only touched there
+    size_t m_Allocated;
+    std::atomic<int64_t> m_Balance;
+    std::vector<char*> m_Slabs;
+};
+
+#define DECLARE_SLAB_ALLOCATOR(type) \
+    static void* operator new(size_t size) \
+    { \
+        assert(size == sizeof(type)); \
+        return CSlabPool::Allocate<type>(); \
+    } \
+    static void operator delete(void* ptr) \
+    { \
+        CSlabPool::Free<type>(ptr); \
     }
 
-    std::chrono::milliseconds GetDuration() const
+
+// intrusive reference count, saves the separate control block and its
+// atomic traffic of std::shared_ptr
+template <typename T>
+class CRefCounted
+{
+public:
+    CRefCounted() : m_RefCount(0)
     {
-        return m_Duration;
     }
 
-    void RecordStartTime()
+    void IncRef()
     {
-        m_StartTime = ClockType::now();
+        m_RefCount.fetch_add(1, std::memory_order_relaxed);
     }
 
-    std::chrono::time_point<ClockType> GetStartTime() const
+    void DecRef()
     {
-        return m_StartTime;
+        if (m_RefCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            delete static_cast<T*>(this);
+        }
     }
 
-    bool IsMainThreadInjector() const
+private:
+    std::atomic<uint32_t> m_RefCount;
+};
+
+template <typename T>
+class CRefPtr
+{
+public:
+    CRefPtr() : m_Ptr(nullptr)
     {
-        return m_ThState.IsMainThread();
     }
 
-    void Release()
+    CRefPtr(std::nullptr_t) : m_Ptr(nullptr)
     {
-        m_IsValid = false;
-        Py_CLEAR(m_Callback);
     }
 
-    bool IsValid() const
+    explicit CRefPtr(T* ptr) : m_Ptr(ptr)
     {
-        return m_IsValid;
-    }
-
-    static void FastCall(const std::shared_ptr<CLocalInjector>& injector)
-    {
-        if (!injector->IsValid())
+        if (m_Ptr)
         {
-            return;
+            m_Ptr->IncRef();
         }
+    }
 
-        int res = Py_AddPendingCall(OnFastTrace, new CFastArgWrapper(injector));
-        if (res == -1)
-        {
-            // TODO: if add pending failed, add it after some pending calls called
-        }
+    CRefPtr(const CRefPtr& rhs) : CRefPtr(rhs.m_Ptr)
+    {
     }
 
-    static void Call(const std::shared_ptr<CLocalInjector>& injector)
+    CRefPtr(CRefPtr&& rhs) : m_Ptr(rhs.m_Ptr)
     {
-        if (!injector->IsValid())
-        {
-            return;
-        }
-        // wrap a injector ptr to keep its reference count
-        auto wrapper = CArgWrapper::Create(injector);
-        injector->m_ThState.SwapState();
+        rhs.m_Ptr = nullptr;
+    }
 
-        auto state = PyThreadState_GET();
-        wrapper->tracefunc = state->c_tracefunc;
-        Py_XINCREF(state->c_traceobj);
-        wrapper->pyTraceobj = state->c_traceobj;
-        const auto capsule = wrapper->CreateCapsule();
-        if (!capsule)
+    ~CRefPtr()
+    {
+        if (m_Ptr)
         {
-            Py_FatalError("Create capsule failed");
+            m_Ptr->DecRef();
         }
-        PyEval_SetTrace(OnTrace, capsule.Get());
-        injector->m_ThState.RestoreState();
     }
 
-protected:
-    static int OnFastTrace(void* arg)
+    CRefPtr& operator=(const CRefPtr& rhs)
     {
-        auto wrapper = reinterpret_cast<CFastArgWrapper*>(arg);
-        auto &injector = wrapper->injector;
-        if (!injector->IsValid())
-        {
-            delete wrapper;
-            return 0;
-        }
-        PyObject* callback = injector->GetCallback();
-        assert(callback);
-        PyObject* pyStartTime = TimePointToPyFloat(injector->m_StartTime);
-        PyObject* res = PyObject_CallFunction(callback, "O", pyStartTime);
-        delete wrapper;
-        if (res == nullptr)
-        {
-            return -1;
-        }
-        Py_DECREF(res);
-        return 0;
+        CRefPtr(rhs).Swap(*this);
+        return *this;
     }
 
-    static int OnTrace(PyObject* self, PyFrameObject* frame,
-        int what, PyObject* arg)
+    CRefPtr& operator=(CRefPtr&& rhs)
     {
-        PyObject* capsule = PyThreadState_GET()->c_traceobj;
-        assert(capsule && PyCapsule_CheckExact(capsule));
-        Py_INCREF(capsule);
-        auto wrapper = CArgWrapper::RestoreFromCapsule(capsule);
-        assert(wrapper != nullptr);
-        // recover the old trace
-        PyEval_SetTrace(wrapper->tracefunc, wrapper->pyTraceobj);
+        CRefPtr(std::move(rhs)).Swap(*this);
+        return *this;
+    }
 
-        PyObject* pyStartTime = TimePointToPyFloat(wrapper->injector->m_StartTime);
-        PyObject* callback = wrapper->injector->GetCallback();
-        if (!wrapper->injector->IsValid())
-        {
-            return 0;
-        }
-        PyObject* res = PyObject_CallFunction(callback, "(d)", pyStartTime);
-        Py_DECREF(capsule);
-        if (res == nullptr)
-        {
-            return -1;
-        }
-        Py_DECREF(res);
-        return 0;
+    CRefPtr& operator=(std::nullptr_t)
+    {
+        CRefPtr().Swap(*this);
+        return *this;
     }
 
-private:
-    bool m_IsValid;
-    PyObject* m_Callback;
-    std::chrono::milliseconds m_Duration;
-    std::chrono::time_point<ClockType> m_StartTime;
-    CThreadState m_ThState;
-};
+    void Swap(CRefPtr& rhs)
+    {
+        std::swap(m_Ptr, rhs.m_Ptr);
+    }
 
+    T* operator->() const
+    {
+        return m_Ptr;
+    }
 
-class CInjectorQueue
-{
-public:
-    bool Empty() const
+    T& operator*() const
     {
-        std::lock_guard<std::mutex> lock(m_Mutex);
-        return m_Queue.empty();
+        return *m_Ptr;
     }
 
-    void Push(const std::shared_ptr<CLocalInjector>& injector)
+    T* get() const
     {
-        std::lock_guard<std::mutex> lock(m_Mutex);
-        m_Queue.push(injector);
+        return m_Ptr;
     }
 
-    std::shared_ptr<CLocalInjector> Pop()
+    explicit operator bool() const
     {
-        std::lock_guard<std::mutex> lock(m_Mutex);
-        if (m_Queue.empty())
-        {
-            return nullptr;
-        }
-        auto injector = m_Queue.front();
-        m_Queue.pop();
-        return injector;
+        return m_Ptr != nullptr;
     }
 
 private:
-    std::queue<std::shared_ptr<CLocalInjector> > m_Queue;
-    mutable std::mutex m_Mutex;
+    T* m_Ptr;
 };
 
-#ifdef WITH_THREAD
-class CAttacher
+
+struct CMpscNode
 {
-private:
-    CAttacher()
+    std::atomic<CMpscNode*> next;
+};
+
+// intrusive multi-producer/single-consumer queue (Vyukov),
+// Push is wait-free, Pop and Empty may only be called by the consumer
+class CMpscQueue
+{
+public:
+    CMpscQueue() : m_Head(&m_Stub), m_Tail(&m_Stub)
     {
+        m_Stub.next.store(nullptr, std::memory_order_relaxed);
     }
 
-public:
-    static CAttacher& Instance()
+    CMpscQueue(const CMpscQueue&) = delete;
+    CMpscQueue& operator=(const CMpscQueue&) = delete;
+
+    void Push(CMpscNode* node)
     {
-        static CAttacher instance;
-        return instance;
+        node->next.store(nullptr, std::memory_order_relaxed);
+        CMpscNode* prev = m_Head.exchange(node, std::memory_order_seq_cst);
+        prev->next.store(node, std::memory_order_release);
     }
 
-    static void Attach(const std::shared_ptr<CLocalInjector>& injector)
+    // return nullptr if the queue is empty or a producer is in the middle of a push
+    CMpscNode* Pop()
     {
-        if (injector->IsMainThreadInjector())
+        CMpscNode* tail = m_Tail;
+        CMpscNode* next = tail->next.load(std::memory_order_acquire);
+        if (tail == &m_Stub)
+        {
+            if (next == nullptr)
+            {
+                return nullptr;
+            }
+            m_Tail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr)
         {
-            CLocalInjector::FastCall(injector);
+            m_Tail = next;
+            return tail;
         }
-        else
+        if (tail != m_Head.load(std::memory_order_acquire))
         {
-            CGILHolder gil;
-            CLocalInjector::Call(injector);
+            return nullptr;
+        }
+        Push(&m_Stub);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next != nullptr)
+        {
+            m_Tail = next;
+            return tail;
         }
+        return nullptr;
+    }
+
+    bool Empty() const
+    {
+        return m_Tail == &m_Stub &&
+            m_Head.load(std::memory_order_seq_cst) == &m_Stub;
     }
+
+    // only while no producer can run, a push cut short by a fork is dropped
+    void Reset()
+    {
+        m_Stub.next.store(nullptr, std::memory_order_relaxed);
+        m_Head.store(&m_Stub, std::memory_order_relaxed);
+        m_Tail = &m_Stub;
+    }
+
+private:
+    std::atomic<CMpscNode*> m_Head;
+    CMpscNode* m_Tail;
+    CMpscNode m_Stub;
 };
 
-#else
-class CAttacher
+// process wide counters of the checker and the deliveries, see stats().
+// relaxed atomics on paths that run once per timer event, never per start/stop
+class CStats
 {
-private:
-    CAttacher() : m_Appended(false)
+public:
+    enum Counter
+    {
+        MERGED,
+        EXPIRED,
+        CANCELLED,
+        RESCHEDULED,
+        DELIVERED,
+        HARD_RAISED,
+        LAG_TOTAL_NS,
+        LAG_MAX_NS,
+        PENDING_CALL_FAILED,
+        GIL_WAITS,
+        GIL_WAIT_TOTAL_NS,
+        GIL_WAIT_MAX_NS,
+        CHECKER_WAKEUPS,
+        CHECKER_BUSY_NS,
+        COUNTER_COUNT
+    };
+
+    CStats() : m_Timers(0)
     {
+        for (auto& counter : m_Counters)
+        {
+            counter.store(0, std::memory_order_relaxed);
+        }
     }
 
-public:
-    static CAttacher& Instance()
+    static CStats& Instance()
     {
-        static CAttacher instance;
+        static CStats instance;
         return instance;
     }
 
-    static void Attach(const std::shared_ptr<CLocalInjector>& injector)
+    void Add(Counter counter, uint64_t value = 1)
     {
-        Instance().InjectRequest(injector);
+        m_Counters[counter].fetch_add(value, std::memory_order_relaxed);
     }
 
-protected:
-    static int OnCall(void* arg)
+    void AddDuration(Counter total, Counter max, ClockType::duration duration)
     {
-        auto attacher = static_cast<CAttacher*>(arg);
-        attacher->Handle();
-        attacher->m_Appended = false;
-        attacher->Handle();
-        return 0;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+        uint64_t value = ns > 0 ? static_cast<uint64_t>(ns) : 0;
+        Add(total, value);
+        uint64_t current = m_Counters[max].load(std::memory_order_relaxed);
+        while (current < value &&
+            !m_Counters[max].compare_exchange_weak(current, value, std::memory_order_relaxed))
+        {
+        }
     }
 
-    bool InjectRequest(const std::shared_ptr<CLocalInjector>& injector)
+    // a timeout reached its target, late by now - deadline
+    void OnDelivered(std::chrono::time_point<ClockType> deadline)
     {
-        m_Queue.Push(injector);
-        // state: handling; ok
-        // state: handled, appended set; ok
-        // state: handled, before set appended; fail => need handle again
-        if (m_Appended)
+        Add(DELIVERED);
+        AddDuration(LAG_TOTAL_NS, LAG_MAX_NS, ClockType::now() - deadline);
+    }
+
+    // entries in the checkers' heaps, stale ones included until they are dropped.
+    // every checker adds the change of its own size, negative when it shrinks
+    void AddTimers(int64_t delta)
+    {
+        m_Timers.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    PyObject* ToDict(bool reset)
+    {
+        static const char* names[COUNTER_COUNT] = {
+            "merged", "expired", "cancelled", "rescheduled", "delivered", "hard_raised", "lag_total_ns", "lag_max_ns",
+            "pending_call_failed", "gil_waits", "gil_wait_total_ns", "gil_wait_max_ns",
+            "checker_wakeups", "checker_busy_ns",
+        };
+        uint64_t values[COUNTER_COUNT];
+        for (int i = 0; i < COUNTER_COUNT; ++i)
         {
-            return true;
+            values[i] = reset ? m_Counters[i].exchange(0, std::memory_order_relaxed) :
+                m_Counters[i].load(std::memory_order_relaxed);
         }
-        m_Appended = true;
-        if (Py_AddPendingCall(OnCall, this) != 0)
+        CPyObjectHolder dict = PyDict_New();
+        if (!dict)
         {
-            return false;
+            return nullptr;
         }
-        return true;
-    }
-
-    void Handle()
-    {
-        while (!m_Queue.Empty())
+        for (int i = 0; i < COUNTER_COUNT; ++i)
         {
-            auto injector = m_Queue.Pop();
-            if (injector.get() == nullptr)
+            CPyObjectHolder value = PyLong_FromUnsignedLongLong(values[i]);
+            if (!value || PyDict_SetItemString(dict, names[i], value) != 0)
             {
-                continue;
+                return nullptr;
             }
-            CLocalInjector::Call(injector);
         }
+        CPyObjectHolder timers = PyLong_FromLongLong(m_Timers.load(std::memory_order_relaxed));
+        if (!timers || PyDict_SetItemString(dict, "timers", timers) != 0)
+        {
+            return nullptr;
+        }
+        PyObject* result = dict;
+        Py_INCREF(result);
+        return result;
     }
 
 private:
-    CInjectorQueue m_Queue;
-    std::atomic<bool> m_Appended;
+    std::atomic<uint64_t> m_Counters[COUNTER_COUNT];
+    std::atomic<int64_t> m_Timers;
 };
 
-#endif // WITH_THREAD
 
-class CContextHelper
+class CLocalInjector;
+using CInjectorPtr = CRefPtr<CLocalInjector>;
+
+// deadlines armed on one thread, only used by that thread. the checker only
+// has to know the earliest one that hasn't fired yet, so nested guards ending
+// after it stay here without touching the checker queue. the next one is
+// published when the covering deadline is stopped or fires.
+// T is the injector, which needs this before it is complete
+template<class T>
+class CDeadlineStack
 {
 private:
-    CContextHelper() :
-        m_IsQuit(false), m_Running(false)
+    using TimePoint = std::chrono::time_point<ClockType>;
+    using Ptr = CRefPtr<T>;
+
+    struct CEntry
     {
-    }
+        Ptr injector;
+        uint32_t generation;
+        TimePoint deadline;
+        // earliest deadline of this entry and the ones below it, see GetBudget
+        TimePoint budget;
+        bool isPublished;
+        bool isFired;
+    };
 
 public:
-    ~CContextHelper()
+    CDeadlineStack() : m_Covered(TimePoint::max())
+    {
+    }
+
+    // all of these return an injector that has to be published, if any
+    Ptr Push(const Ptr& injector, uint32_t gen)
     {
+        // a re-armed injector replaces its previous entry
+        bool isCovering = Erase(Find(injector.get()));
+        while (!m_Stack.empty() && !IsLive(m_Stack.back()))
         {
-            std::lock_guard<std::mutex> lock(m_Mtx);
-            m_IsQuit = true;
+            isCovering |= Erase(m_Stack.end() - 1);
         }
-        m_RunCond.notify_all();
-        m_CheckTh.join();
+        auto deadline = injector->GetDeadline();
+        auto budget = m_Stack.empty() ? deadline : std::min(deadline, m_Stack.back().budget);
+        m_Stack.push_back(CEntry{ injector, gen, deadline, budget, false, false });
+        injector->SetStacked(gen);
+        if (deadline < m_Covered)
+        {
+            m_Stack.back().isPublished = true;
+            m_Covered = deadline;
+            return injector;
+        }
+        return isCovering ? Walk() : nullptr;
     }
 
-    static CContextHelper& Instance()
+    Ptr Remove(const T* injector)
     {
-        static CContextHelper instance;
-        return instance;
+        return Erase(Find(injector)) ? Walk() : nullptr;
     }
 
-    void Start(const std::shared_ptr<CLocalInjector>& pInjector)
+    Ptr OnDelivered(const T* injector, uint32_t gen)
     {
-        std::lock_guard<std::mutex> lock(m_CallMapMtx);
-        AddTimeoutCallback(pInjector);
-        if (!m_Running)
-        {
-            m_Running = true;
-        }
-        if (!m_CheckTh.joinable())
+        auto it = Find(injector);
+        if (it == m_Stack.end() || it->generation != gen || it->isFired)
         {
-            m_IsQuit = false;
-            m_CheckTh = std::thread(
-                std::bind(&CContextHelper::CheckThread, this));
+            return nullptr;
         }
-        m_RunCond.notify_one();
+        it->isFired = true;
+        return it->deadline == m_Covered || !IsLive(*it) ? Walk() : nullptr;
     }
 
-    void Stop(std::shared_ptr<CLocalInjector>& pInjector)
+    // the earliest deadline of the armed guards, fired ones included, max if
+    // none. the innermost live entry has it unless exclude is that one.
+    // stopped entries below it that aren't dropped yet may only make it earlier
+    TimePoint GetBudget(const T* exclude) const
     {
-        std::lock_guard<std::mutex> lock(m_CallMapMtx);
-        pInjector->Release();
-        if (m_CallMap.find(pInjector.get()) == m_CallMap.end())
-        {
-            return;
-        }
-        if (m_Running)
+        for (auto it = m_Stack.rbegin(); it != m_Stack.rend(); ++it)
         {
-            // delete later
-            m_DelVect.push_back(pInjector.get());
-            return;
+            if (IsLive(*it) && it->injector.get() != exclude)
+            {
+                return it->budget;
+            }
         }
-        m_CallMap.erase(pInjector.get());
+        return TimePoint::max();
     }
 
-protected:
-    void CheckThread()
+    // the thread is gone, drop the references back to its injectors
+    void Clear()
     {
-        while (!m_IsQuit)
+        for (auto& entry : m_Stack)
         {
-            
-#ifdef WIN32
-            timeBeginPeriod(1);
-#endif // WIN32
-            do
+            if (entry.injector->IsStackedAt(entry.generation))
             {
-                std::chrono::nanoseconds minSpan(LLONG_MAX);
-                auto startTime = ClockType::now();
-                // TODO: use interval merge for optimization
-                for (auto iter = m_CallMap.begin(); iter != m_CallMap.end();)
-                {
-                    auto& injector = iter->second;
-                    auto span = ClockType::now() - injector->GetStartTime();
-                    const auto& duration = injector->GetDuration();
-
-                    if (span > duration)
-                    {
-                        CAttacher::Attach(injector);
-                        assert(iter->second.use_count() > 1);
-                        iter = m_CallMap.erase(iter);
-                        continue;
-                    }
-                    else
-                    {
-                        minSpan = std::min(minSpan, duration - span);
-                    }
+                entry.injector->SetStacked(0);
+            }
+        }
+        m_Stack.clear();
+        m_Covered = TimePoint::max();
+    }
 
-                    if (m_IsQuit)
-                    {
-                        break;
-                    }
-                    ++iter;
-                }
+private:
+    static bool IsLive(const CEntry& entry)
+    {
+        return entry.injector->IsArmed(entry.generation);
+    }
 
-                Merge();
-                if (m_CallMap.empty())
-                {
-                    m_Running = false;
-                }
-                auto endTime = ClockType::now();
-                if (minSpan - (endTime - startTime) > INTERVAL_RESOLUTION)
-                {
-                    AccurateSleep(1);
-                }
-            } while (m_Running);
-#ifdef WIN32
-            timeEndPeriod(1);
-#endif // WIN32
-            if (!m_IsQuit)
+    typename std::vector<CEntry>::iterator Find(const T* injector)
+    {
+        // mostly the innermost guard
+        for (auto it = m_Stack.end(); it != m_Stack.begin();)
+        {
+            --it;
+            if (it->injector.get() == injector)
             {
-                std::unique_lock<std::mutex> lock(m_Mtx);
-                m_RunCond.wait(lock);
+                return it;
             }
         }
+        return m_Stack.end();
     }
 
-    void AddTimeoutCallback(const std::shared_ptr<CLocalInjector>& pInjector)
+    // return true if it was the covering deadline
+    bool Erase(typename std::vector<CEntry>::iterator it)
     {
-        if (m_Running)
+        if (it == m_Stack.end())
         {
-            m_NewVect.push_back(pInjector);
-            return;
+            return false;
         }
-        m_CallMap[pInjector.get()] = pInjector;
+        bool isCovering = !it->isFired && it->deadline == m_Covered;
+        if (it->injector->IsStackedAt(it->generation))
+        {
+            it->injector->SetStacked(0);
+        }
+        UpdateBudgets(m_Stack.erase(it));
+        return isCovering;
     }
 
-    void Merge()
+    // mostly nothing to do, guards are stopped innermost first
+    void UpdateBudgets(typename std::vector<CEntry>::iterator it)
     {
-        std::lock_guard<std::mutex> lock(m_CallMapMtx);
-        for (auto& item : m_DelVect)
+        for (; it != m_Stack.end(); ++it)
         {
-            m_CallMap.erase(item);
+            it->budget = it == m_Stack.begin() ? it->deadline :
+                std::min(it->deadline, (it - 1)->budget);
         }
-        m_DelVect.clear();
+    }
 
-        for (auto& item : m_NewVect)
+    // drop the stopped entries and make sure the earliest one left is published
+    Ptr Walk()
+    {
+        auto end = std::remove_if(m_Stack.begin(), m_Stack.end(), [](const CEntry& entry)
         {
-            // it maybe released
-            if (!item->IsValid())
+            if (IsLive(entry))
             {
-                continue;
+                return false;
             }
-            m_CallMap[item.get()] = item;
-        }
-        m_NewVect.clear();
-
-    }
-
-private:
-    using CallMapType = std::unordered_map<
-        CLocalInjector*, std::shared_ptr<CLocalInjector> >;
-
-    std::thread m_CheckTh;
-    std::atomic<bool> m_IsQuit;
-    std::atomic<bool> m_Running;
-    std::mutex m_Mtx;
-    std::condition_variable m_RunCond;
-
-    CallMapType m_CallMap;
-    std::mutex m_CallMapMtx;
-    std::vector<std::shared_ptr<CLocalInjector> > m_NewVect;
-    std::vector<CLocalInjector*> m_DelVect;
-};
+            if (entry.injector->IsStackedAt(entry.generation))
+            {
+                entry.injector->SetStacked(0);
+            }
+            return true;
+        });
+        m_Stack.erase(end, m_Stack.end());
+        UpdateBudgets(m_Stack.begin());
 
-#ifdef WITH_THREAD
-static int GetPyThreadIndex()
-{
-    auto state = PyThreadState_GET();
-    int index = -1;
-    for (int i = 0; i < 100000; i++) {
-        void* value = PyThread_get_key_value(i);
-        if (value == state)
+        CEntry* earliest = nullptr;
+        for (auto& entry : m_Stack)
+        {
+            if (!entry.isFired && (earliest == nullptr || entry.deadline < earliest->deadline))
+            {
+                earliest = &entry;
+            }
+        }
+        if (earliest == nullptr)
+        {
+            m_Covered = TimePoint::max();
+            return nullptr;
+        }
+        m_Covered = earliest->deadline;
+        if (earliest->isPublished)
         {
-            index = i;
-            break;
+            return nullptr;
         }
+        earliest->isPublished = true;
+        return earliest->injector;
     }
-    assert(index != -1);
-    return index;
-}
-#endif // WITH_THREAD
 
-
-struct PyInjector
-{
-    PyObject_HEAD;
-    std::shared_ptr<CLocalInjector> injector;
+    std::vector<CEntry> m_Stack;
+    // earliest deadline not fired yet, its entry is always published
+    TimePoint m_Covered;
+};
+
+class CInterpreter;
+
+// per-thread delivery state, the delivery thread hands timeouts over and the
+// thread itself picks them up on its next monitoring event. it outlives the
+// thread as long as an injector created there refers to it.
+// a thread running in several interpreters has one per interpreter
+class CThreadDelivery : public CRefCounted<CThreadDelivery>
+{
+public:
+    using Item = std::pair<CInjectorPtr, uint32_t>;
+
+    // defined after CInterpreter
+    CThreadDelivery(const CRefPtr<CInterpreter>& interp, PyThreadState* state);
+
+    // defined after CInterpreter
+    static const CRefPtr<CThreadDelivery>& Current();
+
+#ifdef USE_ATFORK
+    // in the child of a fork, the deadlines the forking thread had armed are
+    // dropped with the timers of the parent, the stacks of the others are dead
+    static void ResetAfterFork();
+#endif // USE_ATFORK
+
+    bool IsCurrentThread() const
+    {
+        return m_ThreadId == GetCurThreadId();
+    }
+
+    // null only for a thread that never had a thread state, see Current
+    const CRefPtr<CInterpreter>& GetInterpreter() const
+    {
+        return m_Interp;
+    }
+
+    long GetThreadId() const
+    {
+        return m_ThreadId;
+    }
+
+    // timeouts of the main thread of the main interpreter go by pending calls
+    bool IsMainThread() const
+    {
+        return m_ThState.IsMainThread();
+    }
+
+    CThreadState& GetThState()
+    {
+        return m_ThState;
+    }
+
+    // the checker that owns the deadlines of this thread
+    uint32_t GetChecker() const
+    {
+        return m_Checker;
+    }
+
+    // owner thread only
+    CDeadlineStack<CLocalInjector>& GetDeadlines()
+    {
+        return m_Deadlines;
+    }
+
+    // checked on every event without any lock
+    bool HasPending() const
+    {
+        return m_HasPending.load(std::memory_order_acquire);
+    }
+
+    // the rest is guarded by the owner of the delivery, see CMonitorHook
+    void Push(const CInjectorPtr& injector, uint32_t gen)
+    {
+        m_Pending.emplace_back(injector, gen);
+        m_HasPending.store(true, std::memory_order_release);
+    }
+
+    std::vector<Item> Take()
+    {
+        std::vector<Item> items;
+        items.swap(m_Pending);
+        m_HasPending.store(false, std::memory_order_release);
+        return items;
+    }
+
+    std::vector<Item>& GetPending()
+    {
+        return m_Pending;
+    }
+
+    void SetPending(bool pending)
+    {
+        m_HasPending.store(pending, std::memory_order_release);
+    }
+
+    // in the targets of CMonitorHook, guarded by its m_Mtx
+    bool IsTarget() const
+    {
+        return m_IsTarget;
+    }
+
+    void SetTarget(bool target)
+    {
+        m_IsTarget = target;
+    }
+
+private:
+    // round robin over the current count, a thread keeps its checker for good
+    static uint32_t NextChecker()
+    {
+        static std::atomic<uint32_t> next(0);
+        return next.fetch_add(1, std::memory_order_relaxed) %
+            g_CheckerCount.load(std::memory_order_relaxed);
+    }
+
+    struct COwner
+    {
+        ~COwner()
+        {
+            for (auto& delivery : deliveries)
+            {
+                delivery->m_Deadlines.Clear();
+            }
+        }
+
+        // the one used last at the back
+        std::vector<CRefPtr<CThreadDelivery> > deliveries;
+    };
+
+    static COwner& Owner();
+
+    bool m_IsTarget;
+    const long m_ThreadId;
+    const uint32_t m_Checker;
+    const CRefPtr<CInterpreter> m_Interp;
+    CThreadState m_ThState;
+    CDeadlineStack<CLocalInjector> m_Deadlines;
+    std::atomic<bool> m_HasPending;
+    std::vector<Item> m_Pending;
+};
+
+
+// defined after CContextHelper, see CDeadlineStack
+static void OnDeadlineDelivered(const CInjectorPtr& injector, uint32_t gen);
+
+class CLocalInjector : public CMpscNode, public CRefCounted<CLocalInjector>
+{
+    friend class CContextHelper;
+
+private:
+    using TimePoint = std::chrono::time_point<ClockType>;
+
+    // the timeouts of one thread handed over in a single trace hook
+    class CArgWrapper
+    {
+    private:
+        CArgWrapper(std::vector<CThreadDelivery::Item>&& items)
+            : items(std::move(items)), tracefunc(nullptr)
+        {
+        }
+
+    public:
+        DECLARE_SLAB_ALLOCATOR(CArgWrapper)
+
+        std::vector<CThreadDelivery::Item> items;
+        Py_tracefunc tracefunc;
+        CPyObjectHolder pyTraceobj;
+
+        static CArgWrapper* Create(std::vector<CThreadDelivery::Item>&& items)
+        {
+            return new CArgWrapper(std::move(items));
+        }
+
+        static CArgWrapper* RestoreFromCapsule(PyObject* obj)
+        {
+            return static_cast<CArgWrapper*>(PyCapsule_GetPointer(obj, "ArgWrapper"));
+        }
+
+        CPyObjectHolder CreateCapsule()
+        {
+            return PyCapsule_New(this, "ArgWrapper", OnReleaseCapsule);
+        }
+
+    private:
+        static void OnReleaseCapsule(PyObject* obj)
+        {
+            auto _this = static_cast<CArgWrapper*>(
+                PyCapsule_GetPointer(obj, "ArgWrapper"));
+            delete _this;
+        }
+    };
+
+public:
+    DECLARE_SLAB_ALLOCATOR(CLocalInjector)
+
+    CLocalInjector() : m_IsValid(true), m_Generation(0), m_IsQueued(false),
+        m_Deadline(0), m_StackedGen(0), m_ExpiredGen(0), m_Callback(nullptr), m_Sink(nullptr), m_HasCallback(false), m_HasSink(false),
+        m_IsCapture(false), m_IsWatchdog(false),
+        m_NativeCallback(nullptr), m_NativeArg(nullptr), m_HardException(nullptr), m_HardDelay(0), m_SiteId(0),
+        m_Duration(0), m_BaseDuration(0), m_IsInheriting(false),
+        m_Delivery(CThreadDelivery::Current())
+    {
+    }
+
+    ~CLocalInjector()
+    {
+        assert(!m_IsValid);
+    }
+
+    PyObject* GetCallback() const
+    {
+        return m_Callback;
+    }
+
+    // null if only the hard deadline is used
+    void SetCallback(PyObject* func)
+    {
+        Py_XINCREF(func);
+        Py_XSETREF(m_Callback, func);
+        m_HasCallback = func != nullptr;
+    }
+
+    bool HasCallback() const
+    {
+        return m_HasCallback;
+    }
+
+    // run by the checker itself at the deadline, without the GIL, see xtimeout_capi.h
+    void SetNativeCallback(XTimeoutNativeCallback callback, void* arg)
+    {
+        m_NativeCallback = callback;
+        m_NativeArg = arg;
+    }
+
+    bool CallNative(uint32_t gen) const
+    {
+        if (m_NativeCallback == nullptr)
+        {
+            return false;
+        }
+        if (IsArmed(gen))
+        {
+            CStats::Instance().OnDelivered(LoadDeadline());
+            m_NativeCallback(m_NativeArg);
+        }
+        return true;
+    }
+
+    // with a sink the timeouts are handed to it instead of the creating thread,
+    // see CSinkBatch
+    PyObject* GetSink() const
+    {
+        return m_Sink;
+    }
+
+    void SetSink(PyObject* sink)
+    {
+        Py_XINCREF(sink);
+        Py_XSETREF(m_Sink, sink);
+        m_HasSink = sink != nullptr;
+    }
+
+    bool HasSink() const
+    {
+        return m_HasSink;
+    }
+
+    // a capturing injector records the stack of its thread instead of running
+    // anything there, the callback is kept as a tag, see CStackRing
+    void SetCapture(bool capture)
+    {
+        m_IsCapture = capture;
+    }
+
+    bool IsCapture() const
+    {
+        return m_IsCapture;
+    }
+
+    // a watchdog is kept alive by heartbeats instead of new armings, see Beat
+    void SetWatchdog(bool watchdog)
+    {
+        m_IsWatchdog = watchdog;
+    }
+
+    bool IsWatchdog() const
+    {
+        return m_IsWatchdog;
+    }
+
+    // move the deadline of the current arming out with a single store, the
+    // checker finds it when the old one is due and reschedules instead of firing.
+    // false if it isn't armed or has expired already, it needs a new arming then
+    bool Beat()
+    {
+        uint32_t gen = m_Generation.load(std::memory_order_relaxed);
+        if (!(gen & 1) || m_ExpiredGen.load(std::memory_order_acquire) == gen)
+        {
+            return false;
+        }
+        RecordStartTime();
+        m_Deadline.store(GetDeadline().time_since_epoch().count(), std::memory_order_relaxed);
+        return true;
+    }
+
+    // the checker handed this arming over for delivery
+    void SetExpired(uint32_t gen)
+    {
+        m_ExpiredGen.store(gen, std::memory_order_release);
+    }
+
+    // exception raised asynchronously in the thread once the deadline is
+    // overrun by delay, without running any Python code before. a null
+    // exception disables it
+    void SetHardDeadline(PyObject* exception, ClockType::duration delay)
+    {
+        Py_XINCREF(exception);
+        Py_XSETREF(m_HardException, exception);
+        m_HardDelay = delay;
+    }
+
+    bool HasHardDeadline() const
+    {
+        return m_HardException != nullptr;
+    }
+
+    ClockType::duration GetHardDelay() const
+    {
+        return m_HardDelay;
+    }
+
+    // requires the GIL
+    void RaiseHard(uint32_t gen)
+    {
+        if (!IsArmed(gen))
+        {
+            return;
+        }
+        CStats::Instance().Add(CStats::HARD_RAISED);
+#if (PY_VERSION_HEX >= 0x03070000)
+        PyThreadState_SetAsyncExc(static_cast<unsigned long>(m_Delivery->GetThreadId()), m_HardException);
+#else
+        PyThreadState_SetAsyncExc(m_Delivery->GetThreadId(), m_HardException);
+#endif
+    }
+
+    // the guard site the elapsed time is recorded for at stop, 0 if none
+    void SetSiteId(uint32_t site)
+    {
+        m_SiteId = site;
+    }
+
+    uint32_t GetSiteId() const
+    {
+        return m_SiteId;
+    }
+
+    // time since the latest arming, also safe from another thread
+    ClockType::duration GetElapsed() const
+    {
+        return ClockType::now() - LoadDeadline() +
+            std::chrono::duration_cast<ClockType::duration>(m_Duration);
+    }
+
+    // deadline of the latest arming, also safe from another thread
+    TimePoint LoadDeadline() const
+    {
+        return TimePoint(ClockType::duration(m_Deadline.load(std::memory_order_relaxed)));
+    }
+
+    // delivered by the delivery thread rather than on the thread that armed it
+    bool IsDetached() const
+    {
+        return m_HasSink || m_IsCapture;
+    }
+
+    void SetDuration(std::chrono::nanoseconds duration)
+    {
+        m_Duration = duration;
+        m_BaseDuration = duration;
+    }
+
+    // an inheriting injector never ends after the guards around it, its
+    // duration is cut to their remaining budget on every start
+    void SetInherit(bool inherit)
+    {
+        m_IsInheriting = inherit;
+    }
+
+    bool IsInheriting() const
+    {
+        return m_IsInheriting;
+    }
+
+    void Inherit(TimePoint budget)
+    {
+        m_Duration = m_BaseDuration;
+        if (budget == TimePoint::max())
+        {
+            return;
+        }
+        auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            budget - CArmClock::Instance().Now());
+        m_Duration = std::max(std::chrono::nanoseconds(0), std::min(m_Duration, left));
+    }
+
+    std::chrono::nanoseconds GetDuration() const
+    {
+        return m_Duration;
+    }
+
+    void RecordStartTime()
+    {
+        m_StartTime = CArmClock::Instance().Now();
+    }
+
+    // an odd generation means armed, start and stop move it forward so that
+    // entries and pending calls of a previous arming become stale
+    uint32_t Arm()
+    {
+        uint32_t gen = m_Generation.load(std::memory_order_relaxed);
+        gen += (gen & 1) ? 2 : 1;
+        RecordStartTime();
+        m_Deadline.store(GetDeadline().time_since_epoch().count(), std::memory_order_relaxed);
+        m_Generation.store(gen, std::memory_order_release);
+        return gen;
+    }
+
+    void Disarm()
+    {
+        uint32_t gen = m_Generation.load(std::memory_order_relaxed);
+        if (gen & 1)
+        {
+            m_Generation.store(gen + 1, std::memory_order_release);
+        }
+    }
+
+    bool IsArmed(uint32_t gen) const
+    {
+        return m_IsValid && m_Generation.load(std::memory_order_acquire) == gen;
+    }
+
+    // the arming kept on the deadline stack of the owner thread, 0 if none
+    void SetStacked(uint32_t gen)
+    {
+        m_StackedGen.store(gen, std::memory_order_release);
+    }
+
+    bool IsStackedAt(uint32_t gen) const
+    {
+        return m_StackedGen.load(std::memory_order_acquire) == gen;
+    }
+
+    // armed, or stopped from another thread while the owner still has it on
+    // the stack, the owner has to see it once to publish what it covered
+    bool NeedsDelivery(uint32_t gen) const
+    {
+        return IsArmed(gen) || IsStackedAt(gen);
+    }
+
+    std::chrono::time_point<ClockType> GetStartTime() const
+    {
+        return m_StartTime;
+    }
+
+    TimePoint GetDeadline() const
+    {
+        return m_StartTime + std::chrono::duration_cast<ClockType::duration>(m_Duration);
+    }
+
+    bool IsMainThreadInjector() const
+    {
+        return m_Delivery->IsMainThread();
+    }
+
+    PyThreadState* GetThreadState() const
+    {
+        return m_Delivery->GetThState().GetState();
+    }
+
+    const CRefPtr<CThreadDelivery>& GetDelivery() const
+    {
+        return m_Delivery;
+    }
+
+    void Release()
+    {
+        m_IsValid = false;
+        Disarm();
+        Py_CLEAR(m_Callback);
+        Py_CLEAR(m_Sink);
+        Py_CLEAR(m_HardException);
+    }
+
+    bool IsValid() const
+    {
+        return m_IsValid;
+    }
+
+    // run the callback on the main thread from a pending call
+    static int FastCall(const CInjectorPtr& injector, uint32_t gen)
+    {
+        OnDeadlineDelivered(injector, gen);
+        if (!injector->IsArmed(gen))
+        {
+            return 0;
+        }
+        CStats::Instance().OnDelivered(injector->GetDeadline());
+        PyObject* callback = injector->GetCallback();
+        assert(callback);
+        CPyObjectHolder pyStartTime = TimePointToPyFloat(injector->m_StartTime);
+        if (!pyStartTime)
+        {
+            return -1;
+        }
+        CPyObjectHolder res = CallOneArg(callback, pyStartTime);
+        return res ? 0 : -1;
+    }
+
+    // hand the timeouts of one thread over in a single trace hook, they run in
+    // order on its next trace event. requires the GIL
+    static void Call(std::vector<CThreadDelivery::Item>&& items)
+    {
+        items.erase(std::remove_if(items.begin(), items.end(),
+            [](const CThreadDelivery::Item& item) { return !item.first->NeedsDelivery(item.second); }),
+            items.end());
+        if (items.empty())
+        {
+            return;
+        }
+        CThreadState& thState = items.front().first->m_Delivery->GetThState();
+        thState.SwapState();
+
+        auto state = PyThreadState_GET();
+        if (state->c_tracefunc == OnTrace)
+        {
+            // the hook of a previous batch hasn't run yet, it takes these as well
+            auto wrapper = CArgWrapper::RestoreFromCapsule(state->c_traceobj);
+            assert(wrapper != nullptr);
+            std::move(items.begin(), items.end(), std::back_inserter(wrapper->items));
+            thState.RestoreState();
+            return;
+        }
+        auto wrapper = CArgWrapper::Create(std::move(items));
+        wrapper->tracefunc = state->c_tracefunc;
+        Py_XINCREF(state->c_traceobj);
+        wrapper->pyTraceobj = state->c_traceobj;
+        const auto capsule = wrapper->CreateCapsule();
+        if (!capsule)
+        {
+            Py_FatalError("Create capsule failed");
+        }
+        PyEval_SetTrace(OnTrace, capsule.Get());
+        thState.RestoreState();
+    }
+
+protected:
+    static int OnTrace(PyObject* self, PyFrameObject* frame,
+        int what, PyObject* arg)
+    {
+        PyObject* capsule = PyThreadState_GET()->c_traceobj;
+        assert(capsule && PyCapsule_CheckExact(capsule));
+        Py_INCREF(capsule);
+        auto wrapper = CArgWrapper::RestoreFromCapsule(capsule);
+        assert(wrapper != nullptr);
+        // recover the old trace
+        PyEval_SetTrace(wrapper->tracefunc, wrapper->pyTraceobj);
+
+        auto& items = wrapper->items;
+        for (auto it = items.begin(); it != items.end(); ++it)
+        {
+            if (FastCall(it->first, it->second) != 0)
+            {
+                // the exception propagates from here, the rest runs on the next trace event
+                if (it + 1 != items.end())
+                {
+                    PyObject *type, *value, *traceback;
+                    PyErr_Fetch(&type, &value, &traceback);
+                    Call(std::vector<CThreadDelivery::Item>(it + 1, items.end()));
+                    PyErr_Restore(type, value, traceback);
+                }
+                Py_DECREF(capsule);
+                return -1;
+            }
+        }
+        Py_DECREF(capsule);
+        return 0;
+    }
+
+private:
+    std::atomic<bool> m_IsValid;
+    std::atomic<uint32_t> m_Generation;
+
+    // registration state, see CContextHelper::Start and Merge
+    std::atomic<bool> m_IsQueued;
+    std::atomic<ClockType::rep> m_Deadline;
+    CInjectorPtr m_QueuedRef;
+    std::atomic<uint32_t> m_StackedGen;
+    std::atomic<uint32_t> m_ExpiredGen;
+
+    PyObject* m_Callback;
+    PyObject* m_Sink;
+    // read by the checker without the GIL, set before the first start
+    bool m_HasCallback;
+    bool m_HasSink;
+    bool m_IsCapture;
+    bool m_IsWatchdog;
+    XTimeoutNativeCallback m_NativeCallback;
+    void* m_NativeArg;
+    PyObject* m_HardException;
+    ClockType::duration m_HardDelay;
+    uint32_t m_SiteId;
+    std::chrono::nanoseconds m_Duration;
+    std::chrono::nanoseconds m_BaseDuration;
+    bool m_IsInheriting;
+    std::chrono::time_point<ClockType> m_StartTime;
+    CRefPtr<CThreadDelivery> m_Delivery;
+};
+
+
+class CInjectorQueue
+{
+public:
+    using Item = std::pair<CInjectorPtr, uint32_t>;
+
+    bool Empty() const
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_Queue.empty();
+    }
+
+    void Push(const CInjectorPtr& injector, uint32_t gen)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Queue.emplace(injector, gen);
+    }
+
+    Item Pop()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (m_Queue.empty())
+        {
+            return Item(nullptr, 0);
+        }
+        auto injector = m_Queue.front();
+        m_Queue.pop();
+        return injector;
+    }
+
+    void BeforeFork()
+    {
+        m_Mutex.lock();
+    }
+
+    void AfterFork(bool isChild)
+    {
+        if (isChild)
+        {
+            std::queue<Item>().swap(m_Queue);
+        }
+        m_Mutex.unlock();
+    }
+
+private:
+    std::queue<Item> m_Queue;
+    mutable std::mutex m_Mutex;
+};
+
+// collects expired injectors that have a sink, every sink gets a single call
+// with a list of (callback, start_time) per batch, e.g. one event loop
+// wakeup for all of its expired tasks. requires the GIL
+class CSinkBatch
+{
+public:
+    ~CSinkBatch()
+    {
+        Flush();
+    }
+
+    void Add(const CInjectorPtr& injector, uint32_t gen)
+    {
+        if (!injector->IsArmed(gen))
+        {
+            return;
+        }
+        CStats::Instance().OnDelivered(injector->LoadDeadline());
+        PyObject* sink = injector->GetSink();
+        auto it = std::find_if(m_Batches.begin(), m_Batches.end(),
+            [sink](const Batch& batch) { return batch.first.Get() == sink; });
+        if (it == m_Batches.end())
+        {
+            CPyObjectHolder list = PyList_New(0);
+            if (!list)
+            {
+                PyErr_WriteUnraisable(sink);
+                return;
+            }
+            Py_INCREF(sink);
+            m_Batches.emplace_back(CPyObjectHolder(sink), std::move(list));
+            it = m_Batches.end() - 1;
+        }
+        CPyObjectHolder startTime = TimePointToPyFloat(injector->GetStartTime());
+        CPyObjectHolder entry = startTime ?
+            PyTuple_Pack(2, injector->GetCallback(), startTime.Get()) : nullptr;
+        if (!entry || PyList_Append(it->second, entry) != 0)
+        {
+            PyErr_WriteUnraisable(sink);
+        }
+    }
+
+    void Flush()
+    {
+        for (auto& batch : m_Batches)
+        {
+            CPyObjectHolder res = CallOneArg(batch.first, batch.second);
+            if (!res)
+            {
+                PyErr_WriteUnraisable(batch.first);
+            }
+        }
+        m_Batches.clear();
+    }
+
+private:
+    using Batch = std::pair<CPyObjectHolder, CPyObjectHolder>;
+    std::vector<Batch> m_Batches;
+};
+
+// sleeps the last stretch before a deadline with a timer finer than the
+// scheduler tick, the condition variable waits are only good for the coarse part.
+// without timerfd on linux the condition variable is the fallback
+class CPreciseTimer
+{
+public:
+    using TimePoint = std::chrono::time_point<ClockType>;
+
+    CPreciseTimer()
+    {
+#ifdef _WIN32
+        m_Timer = CreateWaitableTimerExW(nullptr, nullptr,
+            CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+        if (!m_Timer)
+        {
+            // before windows 10 1803, down to the 1ms of timeBeginPeriod
+            m_Timer = CreateWaitableTimerW(nullptr, TRUE, nullptr);
+        }
+#endif // _WIN32
+    }
+
+    ~CPreciseTimer()
+    {
+#ifdef _WIN32
+        if (m_Timer)
+        {
+            CloseHandle(m_Timer);
+        }
+#endif // _WIN32
+    }
+
+    void SleepUntil(TimePoint deadline)
+    {
+#ifdef _WIN32
+        auto remain = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - ClockType::now());
+        if (remain.count() <= 0)
+        {
+            return;
+        }
+        LARGE_INTEGER due;
+        // relative, in 100ns units
+        due.QuadPart = -static_cast<LONGLONG>((remain.count() + 99) / 100);
+        if (m_Timer && SetWaitableTimer(m_Timer, &due, 0, nullptr, nullptr, FALSE))
+        {
+            WaitForSingleObject(m_Timer, INFINITE);
+            return;
+        }
+        std::this_thread::sleep_until(deadline);
+#elif defined(__linux__)
+        // steady_clock is CLOCK_MONOTONIC here
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+        timespec ts;
+        ts.tv_sec = static_cast<time_t>(ns / 1000000000);
+        ts.tv_nsec = static_cast<long>(ns % 1000000000);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+        {
+        }
+#else
+        std::this_thread::sleep_until(deadline);
+#endif
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE m_Timer;
+#endif // _WIN32
+};
+
+// what the checker sleeps on between deadlines. on linux one epoll_wait over
+// a timerfd armed to the earliest deadline and an eventfd for wakeups, other
+// platforms and a failed setup use a condition variable with CPreciseTimer
+class CWaiter
+{
+public:
+    using TimePoint = std::chrono::time_point<ClockType>;
+
+    CWaiter() : m_IsNotified(false)
+    {
+#ifdef USE_TIMERFD
+        OpenFds();
+#endif // USE_TIMERFD
+    }
+
+    ~CWaiter()
+    {
+#ifdef USE_TIMERFD
+        CloseFds();
+#endif // USE_TIMERFD
+    }
+
+    // any thread, wakeups while the checker is running are merged into one
+    void WakeUp()
+    {
+        if (m_IsNotified.exchange(true))
+        {
+            return;
+        }
+#ifdef USE_TIMERFD
+        if (m_EpollFd >= 0)
+        {
+            uint64_t one = 1;
+            ssize_t res = write(m_EventFd, &one, sizeof(one));
+            (void)res;
+            return;
+        }
+#endif // USE_TIMERFD
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+        }
+        m_Cond.notify_one();
+    }
+
+    // in the child of a fork, the fds are shared with the checker of the parent
+    // and the lock may be left held by a thread that is gone
+    void ResetAfterFork()
+    {
+#ifdef USE_TIMERFD
+        CloseFds();
+        OpenFds();
+#endif // USE_TIMERFD
+        new (&m_Mtx) std::mutex();
+        new (&m_Cond) std::condition_variable();
+        m_IsNotified = false;
+    }
+
+    // checker only, returns at the deadline, on a wakeup or spuriously
+    void Wait(TimePoint deadline)
+    {
+#ifdef USE_TIMERFD
+        if (m_EpollFd >= 0)
+        {
+            WaitEvents(deadline);
+            m_IsNotified = false;
+            return;
+        }
+#endif // USE_TIMERFD
+        if (deadline != TimePoint::max() &&
+            deadline - ClockType::now() <= PRECISE_WAIT_WINDOW)
+        {
+            m_Timer.SleepUntil(deadline);
+            return;
+        }
+        std::unique_lock<std::mutex> lock(m_Mtx);
+        auto pred = [this]() { return m_IsNotified.load(); };
+        if (deadline == TimePoint::max())
+        {
+            m_Cond.wait(lock, pred);
+        }
+        else
+        {
+            // wake a bit early and sleep the rest precisely
+            m_Cond.wait_until(lock, deadline - PRECISE_WAIT_WINDOW, pred);
+        }
+        m_IsNotified = false;
+    }
+
+private:
+#ifdef USE_TIMERFD
+    void OpenFds()
+    {
+        m_Armed = TimePoint::max();
+        m_EventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        m_TimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        m_EpollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (m_EventFd < 0 || m_TimerFd < 0 || m_EpollFd < 0 ||
+            !Watch(m_EventFd) || !Watch(m_TimerFd))
+        {
+            CloseFds();
+        }
+    }
+
+    bool Watch(int fd)
+    {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        return epoll_ctl(m_EpollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+    }
+
+    void CloseFds()
+    {
+        for (int* fd : { &m_EpollFd, &m_TimerFd, &m_EventFd })
+        {
+            if (*fd >= 0)
+            {
+                close(*fd);
+            }
+            *fd = -1;
+        }
+    }
+
+    void WaitEvents(TimePoint deadline)
+    {
+        // the timer is only touched when the earliest deadline changes
+        if (deadline != m_Armed)
+        {
+            itimerspec spec = {};
+            if (deadline != TimePoint::max())
+            {
+                // steady_clock is CLOCK_MONOTONIC here
+                auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    deadline.time_since_epoch()).count();
+                spec.it_value.tv_sec = static_cast<time_t>(ns / 1000000000);
+                // a zero value would disarm it
+                spec.it_value.tv_nsec = std::max(1L, static_cast<long>(ns % 1000000000));
+            }
+            timerfd_settime(m_TimerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+            m_Armed = deadline;
+        }
+
+        epoll_event events[2];
+        int count = epoll_wait(m_EpollFd, events, 2, -1);
+        for (int i = 0; i < count; ++i)
+        {
+            uint64_t value;
+            ssize_t res = read(events[i].data.fd, &value, sizeof(value));
+            (void)res;
+            if (events[i].data.fd == m_TimerFd)
+            {
+                // it's one-shot, disarmed after firing
+                m_Armed = TimePoint::max();
+            }
+        }
+    }
+
+    int m_EpollFd;
+    int m_TimerFd;
+    int m_EventFd;
+    TimePoint m_Armed;
+#endif // USE_TIMERFD
+
+    std::atomic<bool> m_IsNotified;
+    std::mutex m_Mtx;
+    std::condition_variable m_Cond;
+    CPreciseTimer m_Timer;
+};
+
+// timers of one checker as an 8-ary min-heap kept as struct of arrays. the
+// deadlines are packed on their own, so a sift compares the 8 children of a
+// node within one or two cache lines with a branchless loop, generation and
+// flags sit apart, and the injectors are only dereferenced by the checker
+// when one reaches the top. owned by the checker thread
+class CTimerHeap
+{
+private:
+    static const size_t ARITY = 8;
+
+    using TimePoint = std::chrono::time_point<ClockType>;
+    using Rep = ClockType::rep;
+
+public:
+    struct CEntry
+    {
+        TimePoint deadline;
+        uint32_t generation;
+        CInjectorPtr injector;
+        // the hard deadline that follows the expiry of the arming
+        bool isHard;
+    };
+
+    bool Empty() const
+    {
+        return m_Deadlines.empty();
+    }
+
+    size_t Size() const
+    {
+        return m_Deadlines.size();
+    }
+
+    TimePoint TopDeadline() const
+    {
+        return TimePoint(ClockType::duration(m_Deadlines.front()));
+    }
+
+    uint32_t TopGeneration() const
+    {
+        return m_Generations.front();
+    }
+
+    const CInjectorPtr& TopInjector() const
+    {
+        return m_Injectors.front();
+    }
+
+    void Push(CEntry&& entry)
+    {
+        m_Deadlines.push_back(0);
+        m_Generations.push_back(0);
+        m_Flags.push_back(0);
+        m_Injectors.emplace_back();
+        SiftUp(m_Deadlines.size() - 1, std::move(entry));
+    }
+
+    CEntry Pop()
+    {
+        CEntry top{ TopDeadline(), m_Generations.front(), std::move(m_Injectors.front()),
+            (m_Flags.front() & FLAG_HARD) != 0 };
+        CEntry last = Take(m_Deadlines.size() - 1);
+        m_Deadlines.pop_back();
+        m_Generations.pop_back();
+        m_Flags.pop_back();
+        m_Injectors.pop_back();
+        if (!m_Deadlines.empty())
+        {
+            SiftDown(0, std::move(last));
+        }
+        return top;
+    }
+
+    // drop the entries pred(generation, injector) is true for, return how many
+    template<class Pred>
+    size_t RemoveIf(Pred pred)
+    {
+        size_t size = m_Deadlines.size();
+        size_t kept = 0;
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (pred(m_Generations[i], m_Injectors[i]))
+            {
+                continue;
+            }
+            if (kept != i)
+            {
+                Move(kept, i);
+            }
+            ++kept;
+        }
+        m_Deadlines.resize(kept);
+        m_Generations.resize(kept);
+        m_Flags.resize(kept);
+        m_Injectors.resize(kept);
+        // heapify bottom up
+        for (size_t i = kept > 1 ? (kept - 2) / ARITY + 1 : 0; i-- > 0;)
+        {
+            SiftDown(i, Take(i));
+        }
+        return size - kept;
+    }
+
+private:
+    enum : uint8_t
+    {
+        FLAG_HARD = 1,
+    };
+
+    CEntry Take(size_t pos)
+    {
+        return CEntry{ TimePoint(ClockType::duration(m_Deadlines[pos])), m_Generations[pos],
+            std::move(m_Injectors[pos]), (m_Flags[pos] & FLAG_HARD) != 0 };
+    }
+
+    void Put(size_t pos, CEntry&& entry)
+    {
+        m_Deadlines[pos] = entry.deadline.time_since_epoch().count();
+        m_Generations[pos] = entry.generation;
+        m_Flags[pos] = entry.isHard ? FLAG_HARD : 0;
+        m_Injectors[pos] = std::move(entry.injector);
+    }
+
+    void Move(size_t to, size_t from)
+    {
+        m_Deadlines[to] = m_Deadlines[from];
+        m_Generations[to] = m_Generations[from];
+        m_Flags[to] = m_Flags[from];
+        m_Injectors[to] = std::move(m_Injectors[from]);
+    }
+
+    // pos is a hole, entry goes into it or below
+    void SiftUp(size_t pos, CEntry&& entry)
+    {
+        Rep deadline = entry.deadline.time_since_epoch().count();
+        while (pos > 0)
+        {
+            size_t parent = (pos - 1) / ARITY;
+            if (m_Deadlines[parent] <= deadline)
+            {
+                break;
+            }
+            Move(pos, parent);
+            pos = parent;
+        }
+        Put(pos, std::move(entry));
+    }
+
+    // pos is a hole, entry goes into it or above
+    void SiftDown(size_t pos, CEntry&& entry)
+    {
+        Rep deadline = entry.deadline.time_since_epoch().count();
+        size_t size = m_Deadlines.size();
+        const Rep* deadlines = m_Deadlines.data();
+        while (true)
+        {
+            size_t first = pos * ARITY + 1;
+            if (first >= size)
+            {
+                break;
+            }
+            size_t last = std::min(first + ARITY, size);
+            size_t child = first;
+            for (size_t i = first + 1; i < last; ++i)
+            {
+                child = deadlines[i] < deadlines[child] ? i : child;
+            }
+            if (deadlines[child] >= deadline)
+            {
+                break;
+            }
+            Move(pos, child);
+            pos = child;
+        }
+        Put(pos, std::move(entry));
+    }
+
+    std::vector<Rep> m_Deadlines;
+    std::vector<uint32_t> m_Generations;
+    std::vector<uint8_t> m_Flags;
+    std::vector<CInjectorPtr> m_Injectors;
+};
+
+// stacks of the threads that ran past a capturing injector, taken on the
+// delivery thread while that thread is parked on the GIL, so nothing runs on
+// it. a fixed ring of records keeps the latest ones until they are drained.
+// one per interpreter, guarded by its GIL
+class CStackRing
+{
+private:
+    static const size_t CAPACITY = 1024;
+    static const int MAX_DEPTH = 64;
+
+    using TimePoint = std::chrono::time_point<ClockType>;
+
+    struct CFrame
+    {
+        PyObject* code;
+        int line;
+    };
+
+    struct CRecord
+    {
+        PyObject* tag;
+        TimePoint startTime;
+        TimePoint captureTime;
+        int depth;
+        CFrame frames[MAX_DEPTH];
+    };
+
+public:
+    CStackRing(PyInterpreterState* interp) : m_Interp(interp),
+        m_Records(new CRecord[CAPACITY]()), m_Head(0), m_Count(0)
+    {
+    }
+
+    void Capture(const CInjectorPtr& injector, uint32_t gen)
+    {
+        PyThreadState* state = injector->GetThreadState();
+        if (!injector->IsArmed(gen) || !IsAlive(state))
+        {
+            return;
+        }
+        // overwrite the oldest one when full
+        CRecord& record = m_Records[(m_Head + m_Count) % CAPACITY];
+        if (m_Count == CAPACITY)
+        {
+            Clear(record);
+            m_Head = (m_Head + 1) % CAPACITY;
+        }
+        else
+        {
+            ++m_Count;
+        }
+        CStats::Instance().OnDelivered(injector->LoadDeadline());
+        record.tag = injector->GetCallback();
+        Py_INCREF(record.tag);
+        record.startTime = injector->GetStartTime();
+        record.captureTime = ClockType::now();
+        record.depth = CaptureFrames(state, record.frames);
+    }
+
+    // [(tag, start_time, capture_time, [(code, lineno), ...]), ...], oldest
+    // first and innermost frame first
+    PyObject* Drain()
+    {
+        CPyObjectHolder result = PyList_New(0);
+        if (!result)
+        {
+            return nullptr;
+        }
+        while (m_Count > 0)
+        {
+            CRecord& record = m_Records[m_Head];
+            CPyObjectHolder item = ToPython(record);
+            Clear(record);
+            m_Head = (m_Head + 1) % CAPACITY;
+            --m_Count;
+            if (!item || PyList_Append(result, item) != 0)
+            {
+                return nullptr;
+            }
+        }
+        PyObject* list = result;
+        Py_INCREF(list);
+        return list;
+    }
+
+    // drop the records left when the interpreter goes away
+    void Clear()
+    {
+        for (; m_Count > 0; --m_Count)
+        {
+            Clear(m_Records[m_Head]);
+            m_Head = (m_Head + 1) % CAPACITY;
+        }
+    }
+
+private:
+    bool IsAlive(PyThreadState* state) const
+    {
+        // the injector may outlive its thread
+        PyThreadState* it = PyInterpreterState_ThreadHead(m_Interp);
+        for (; it != nullptr; it = PyThreadState_Next(it))
+        {
+            if (it == state)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static int CaptureFrames(PyThreadState* state, CFrame* frames)
+    {
+        int depth = 0;
+#if (PY_VERSION_HEX >= 0x03090000)
+        PyFrameObject* frame = PyThreadState_GetFrame(state);
+        while (frame != nullptr && depth < MAX_DEPTH)
+        {
+            frames[depth].code = reinterpret_cast<PyObject*>(PyFrame_GetCode(frame));
+            frames[depth].line = PyFrame_GetLineNumber(frame);
+            ++depth;
+            PyFrameObject* back = PyFrame_GetBack(frame);
+            Py_DECREF(frame);
+            frame = back;
+        }
+        Py_XDECREF(frame);
+#else
+        for (PyFrameObject* frame = state->frame;
+            frame != nullptr && depth < MAX_DEPTH; frame = frame->f_back)
+        {
+            frames[depth].code = reinterpret_cast<PyObject*>(frame->f_code);
+            Py_INCREF(frames[depth].code);
+            frames[depth].line = PyFrame_GetLineNumber(frame);
+            ++depth;
+        }
+#endif
+        return depth;
+    }
+
+    static PyObject* ToPython(const CRecord& record)
+    {
+        CPyObjectHolder frames = PyList_New(record.depth);
+        if (!frames)
+        {
+            return nullptr;
+        }
+        for (int i = 0; i < record.depth; ++i)
+        {
+            PyObject* frame = Py_BuildValue("(Oi)", record.frames[i].code, record.frames[i].line);
+            if (!frame)
+            {
+                return nullptr;
+            }
+            PyList_SET_ITEM(frames.Get(), i, frame);
+        }
+        CPyObjectHolder startTime = TimePointToPyFloat(record.startTime);
+        CPyObjectHolder captureTime = TimePointToPyFloat(record.captureTime);
+        if (!startTime || !captureTime)
+        {
+            return nullptr;
+        }
+        return PyTuple_Pack(4, record.tag, startTime.Get(), captureTime.Get(), frames.Get());
+    }
+
+    static void Clear(CRecord& record)
+    {
+        Py_CLEAR(record.tag);
+        for (int i = 0; i < record.depth; ++i)
+        {
+            Py_CLEAR(record.frames[i].code);
+        }
+        record.depth = 0;
+    }
+
+    PyInterpreterState* m_Interp;
+    std::unique_ptr<CRecord[]> m_Records;
+    size_t m_Head;
+    size_t m_Count;
+};
+
+// log-bucket histogram of elapsed nanoseconds, 8 sub-buckets per power of two
+// so a bucket is at most 12.5% wide. written by one thread only, read by snapshots
+class CHistogram
+{
+public:
+    static const int SUB_BITS = 3;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    CHistogram()
+    {
+        for (auto& count : m_Counts)
+        {
+            count.store(0, std::memory_order_relaxed);
+        }
+        std::fill(std::begin(m_Base), std::end(m_Base), 0);
+    }
+
+    void Add(uint64_t value)
+    {
+        auto& count = m_Counts[Index(value)];
+        // single writer, no read-modify-write needed
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // the counts since the last reset, requires the registry lock
+    void Collect(uint64_t* counts, bool reset)
+    {
+        for (int i = 0; i < BUCKETS; ++i)
+        {
+            uint64_t value = m_Counts[i].load(std::memory_order_relaxed);
+            counts[i] += value - m_Base[i];
+            if (reset)
+            {
+                m_Base[i] = value;
+            }
+        }
+    }
+
+    static int Index(uint64_t value)
+    {
+        if (value < SUB_COUNT)
+        {
+            return static_cast<int>(value);
+        }
+        int exp = Log2(value);
+        return (exp - SUB_BITS + 1) * SUB_COUNT +
+            static_cast<int>((value >> (exp - SUB_BITS)) & (SUB_COUNT - 1));
+    }
+
+    static uint64_t LowerBound(int index)
+    {
+        if (index < SUB_COUNT)
+        {
+            return index;
+        }
+        int exp = index / SUB_COUNT + SUB_BITS - 1;
+        return static_cast<uint64_t>(SUB_COUNT + index % SUB_COUNT) << (exp - SUB_BITS);
+    }
+
+private:
+    static int Log2(uint64_t value)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, value);
+        return static_cast<int>(index);
+#else
+        return 63 - __builtin_clzll(value);
+#endif // _MSC_VER
+    }
+
+    std::atomic<uint64_t> m_Counts[BUCKETS];
+    // counts at the last reset
+    uint64_t m_Base[BUCKETS];
+};
+
+// elapsed time of stopped injectors per guard site, e.g. the code object of a
+// decorated function. every thread records into its own histograms, snapshots
+// merge them. the lock is only taken when a thread sees a site for the first
+// time and by snapshots, no Python code runs under it. ids are shared by all
+// interpreters, every site belongs to the one that registered it
+class CSiteRegistry
+{
+private:
+    struct CSite
+    {
+        PyObject* object;
+        const CInterpreter* interp;
+    };
+
+    struct CTable
+    {
+        CTable() : isDead(false)
+        {
+        }
+
+        // indexed by site id, only grown by the owner under the lock
+        std::vector<std::unique_ptr<CHistogram> > histograms;
+        bool isDead;
+    };
+
+    struct COwner
+    {
+        COwner() : table(nullptr)
+        {
+        }
+
+        ~COwner()
+        {
+            if (table)
+            {
+                CSiteRegistry::Instance().Retire(table);
+            }
+        }
+
+        CTable* table;
+    };
+
+    CSiteRegistry()
+    {
+        // id 0 means no site
+        m_Sites.push_back(CSite{ nullptr, nullptr });
+    }
+
+public:
+    static CSiteRegistry& Instance()
+    {
+        static CSiteRegistry instance;
+        return instance;
+    }
+
+    // requires the GIL, the site is kept alive until its interpreter goes away
+    uint32_t Register(PyObject* site, const CInterpreter* interp)
+    {
+        std::lock_guard<std::mutex> lock(m_Mtx);
+        auto it = m_SiteIds.find(site);
+        if (it != m_SiteIds.end())
+        {
+            return it->second;
+        }
+        Py_INCREF(site);
+        m_Sites.push_back(CSite{ site, interp });
+        uint32_t id = static_cast<uint32_t>(m_Sites.size() - 1);
+        m_SiteIds.emplace(site, id);
+        return id;
+    }
+
+    void Record(uint32_t site, ClockType::duration elapsed)
+    {
+        static thread_local COwner owner;
+        CTable* table = owner.table;
+        if (table == nullptr || site >= table->histograms.size() || !table->histograms[site])
+        {
+            table = Prepare(owner, site);
+        }
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        table->histograms[site]->Add(ns > 0 ? static_cast<uint64_t>(ns) : 0);
+    }
+
+    // requires the GIL of interp, its sites are released. their ids aren't
+    // reused, what was recorded for them is left out of snapshots
+    void Release(const CInterpreter* interp)
+    {
+        std::vector<PyObject*> objects;
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+            for (auto& site : m_Sites)
+            {
+                if (site.object != nullptr && site.interp == interp)
+                {
+                    m_SiteIds.erase(site.object);
+                    objects.push_back(site.object);
+                    site.object = nullptr;
+                }
+            }
+        }
+        for (auto object : objects)
+        {
+            Py_DECREF(object);
+        }
+    }
+
+#ifdef USE_ATFORK
+    // a thread takes the lock on its first record and when it exits
+    void BeforeFork()
+    {
+        m_Mtx.lock();
+    }
+
+    void AfterFork()
+    {
+        m_Mtx.unlock();
+    }
+#endif // USE_ATFORK
+
+    // {site: [(lower_bound_ns, count), ...]} of the non-empty buckets of the
+    // sites of interp
+    PyObject* Snapshot(bool reset, const CInterpreter* interp)
+    {
+        std::vector<CSite> sites;
+        std::vector<uint64_t> counts;
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+            // fold the tables of finished threads
+            for (auto it = m_Tables.begin(); it != m_Tables.end();)
+            {
+                if (!(*it)->isDead)
+                {
+                    ++it;
+                    continue;
+                }
+                Collect(**it, m_Retired, false, nullptr);
+                delete *it;
+                it = m_Tables.erase(it);
+            }
+            sites = m_Sites;
+            counts = m_Retired;
+            counts.resize(sites.size() * CHistogram::BUCKETS);
+            for (size_t site = 0; reset && site < sites.size() &&
+                site * CHistogram::BUCKETS < m_Retired.size(); ++site)
+            {
+                if (sites[site].interp == interp)
+                {
+                    std::fill_n(&m_Retired[site * CHistogram::BUCKETS], CHistogram::BUCKETS, 0);
+                }
+            }
+            for (auto table : m_Tables)
+            {
+                Collect(*table, counts, reset, interp);
+            }
+        }
+
+        CPyObjectHolder result = PyDict_New();
+        if (!result)
+        {
+            return nullptr;
+        }
+        for (size_t site = 1; site < sites.size(); ++site)
+        {
+            if (sites[site].object == nullptr || sites[site].interp != interp)
+            {
+                continue;
+            }
+            const uint64_t* histogram = &counts[site * CHistogram::BUCKETS];
+            CPyObjectHolder buckets = PyList_New(0);
+            if (!buckets)
+            {
+                return nullptr;
+            }
+            for (int i = 0; i < CHistogram::BUCKETS; ++i)
+            {
+                if (histogram[i] == 0)
+                {
+                    continue;
+                }
+                CPyObjectHolder bucket = Py_BuildValue("(KK)",
+                    static_cast<unsigned long long>(CHistogram::LowerBound(i)),
+                    static_cast<unsigned long long>(histogram[i]));
+                if (!bucket || PyList_Append(buckets, bucket) != 0)
+                {
+                    return nullptr;
+                }
+            }
+            if (PyList_GET_SIZE(buckets.Get()) != 0 &&
+                PyDict_SetItem(result, sites[site].object, buckets) != 0)
+            {
+                return nullptr;
+            }
+        }
+        PyObject* dict = result;
+        Py_INCREF(dict);
+        return dict;
+    }
+
+private:
+    CTable* Prepare(COwner& owner, uint32_t site)
+    {
+        std::lock_guard<std::mutex> lock(m_Mtx);
+        if (owner.table == nullptr)
+        {
+            owner.table = new CTable();
+            m_Tables.push_back(owner.table);
+        }
+        auto& histograms = owner.table->histograms;
+        if (site >= histograms.size())
+        {
+            histograms.resize(site + 1);
+        }
+        if (!histograms[site])
+        {
+            histograms[site].reset(new CHistogram());
+        }
+        return owner.table;
+    }
+
+    void Retire(CTable* table)
+    {
+        std::lock_guard<std::mutex> lock(m_Mtx);
+        table->isDead = true;
+    }
+
+    // requires the lock, a reset only applies to the sites of interp
+    void Collect(CTable& table, std::vector<uint64_t>& counts, bool reset, const CInterpreter* interp)
+    {
+        counts.resize(m_Sites.size() * CHistogram::BUCKETS);
+        for (size_t site = 0; site < table.histograms.size(); ++site)
+        {
+            if (table.histograms[site])
+            {
+                table.histograms[site]->Collect(&counts[site * CHistogram::BUCKETS],
+                    reset && m_Sites[site].interp == interp);
+            }
+        }
+    }
+
+    std::mutex m_Mtx;
+    std::vector<CSite> m_Sites;
+    // by identity, like the code objects they usually are
+    std::unordered_map<PyObject*, uint32_t> m_SiteIds;
+    std::vector<CTable*> m_Tables;
+    // what the finished threads recorded since the last reset
+    std::vector<uint64_t> m_Retired;
+};
+
+#ifdef USE_SYS_MONITORING
+// one-shot sys.monitoring tool used instead of PyEval_SetTrace, the events are
+// enabled while some thread has a pending timeout and turned off right after,
+// so other tools and the specializing interpreter are left alone.
+// sys.monitoring is per interpreter and so is this.
+// no Python code runs while m_Mtx is held, so it is safe without the GIL
+class CMonitorHook
+{
+private:
+    // events a thread with nothing pending sees before looking for stale targets
+    static const uint32_t PURGE_INTERVAL = 256;
+
+public:
+    CMonitorHook() : m_ToolId(-1), m_Events(0), m_IsFailed(false),
+        m_IsEnabled(false), m_IsSyncing(false), m_IsDirty(false)
+    {
+    }
+
+    // the interpreter goes away, requires its GIL
+    void Clear()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+            for (auto& target : m_Targets)
+            {
+                target->Take();
+                target->SetTarget(false);
+            }
+            m_Targets.clear();
+            m_IsFailed = true;
+        }
+        if (m_IsEnabled)
+        {
+            m_IsEnabled = false;
+            CPyObjectHolder res = PyObject_CallMethod(m_Monitoring, "set_events", "ii", m_ToolId, 0);
+            if (!res)
+            {
+                PyErr_WriteUnraisable(m_Monitoring);
+            }
+        }
+        m_Monitoring = nullptr;
+    }
+
+    // called on the delivery thread with an attached thread state, the
+    // timeouts of one thread are added at once and run in order on its next event.
+    // return false if the tool can't be used
+    bool Arm(const CRefPtr<CThreadDelivery>& target, const std::vector<CThreadDelivery::Item>& items)
+    {
+        if (!Register())
+        {
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+            bool added = false;
+            for (auto& item : items)
+            {
+                if (item.first->NeedsDelivery(item.second))
+                {
+                    target->Push(item.first, item.second);
+                    added = true;
+                }
+            }
+            if (!added)
+            {
+                return true;
+            }
+            AddTarget(target);
+        }
+        Sync();
+        return true;
+    }
+
+protected:
+    bool Register()
+    {
+        if (m_ToolId != -1 || m_IsFailed)
+        {
+            return !m_IsFailed;
+        }
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        m_IsFailed = !DoRegister();
+        if (m_IsFailed)
+        {
+            PyErr_WriteUnraisable(nullptr);
+            m_ToolId = -1;
+        }
+        PyErr_Restore(type, value, traceback);
+        return !m_IsFailed;
+    }
+
+    bool DoRegister()
+    {
+        static PyMethodDef def = {
+            "_on_monitor_event", (PyCFunction)(void(*)(void))OnEvent, METH_FASTCALL, nullptr };
+
+        CPyObjectHolder sys = PyImport_ImportModule("sys");
+        if (!sys)
+        {
+            return false;
+        }
+        m_Monitoring = PyObject_GetAttrString(sys, "monitoring");
+        if (!m_Monitoring)
+        {
+            return false;
+        }
+        // the ids not reserved for debuggers, coverage, profilers and optimizers
+        for (int toolId : { 4, 3 })
+        {
+            CPyObjectHolder res = PyObject_CallMethod(m_Monitoring, "use_tool_id", "is", toolId, "xtimeout");
+            if (res)
+            {
+                m_ToolId = toolId;
+                break;
+            }
+            if (!PyErr_ExceptionMatches(PyExc_ValueError))
+            {
+                return false;
+            }
+            PyErr_Clear();
+        }
+        if (m_ToolId == -1)
+        {
+            PyErr_SetString(PyExc_RuntimeError, "no free sys.monitoring tool id");
+            return false;
+        }
+
+        CPyObjectHolder events = PyObject_GetAttrString(m_Monitoring, "events");
+        CPyObjectHolder self = PyCapsule_New(this, "MonitorHook", nullptr);
+        CPyObjectHolder callback = self ? PyCFunction_New(&def, self) : nullptr;
+        if (!events || !callback)
+        {
+            return false;
+        }
+        // calls, resumed generators, lines and backward jumps of tight loops
+        for (const char* name : { "PY_START", "PY_RESUME", "LINE", "JUMP" })
+        {
+            CPyObjectHolder event = PyObject_GetAttrString(events, name);
+            if (!event)
+            {
+                return false;
+            }
+            long bit = PyLong_AsLong(event);
+            if (bit == -1 && PyErr_Occurred())
+            {
+                return false;
+            }
+            CPyObjectHolder res = PyObject_CallMethod(
+                m_Monitoring, "register_callback", "iOO", m_ToolId, event.Get(), callback.Get());
+            if (!res)
+            {
+                return false;
+            }
+            m_Events |= bit;
+        }
+        return true;
+    }
+
+    // requires m_Mtx
+    void AddTarget(const CRefPtr<CThreadDelivery>& target)
+    {
+        if (!target->IsTarget())
+        {
+            target->SetTarget(true);
+            m_Targets.push_back(target);
+        }
+        m_IsDirty = true;
+    }
+
+    // requires m_Mtx
+    void RemoveTarget(CThreadDelivery* target)
+    {
+        target->SetTarget(false);
+        m_Targets.erase(std::remove_if(m_Targets.begin(), m_Targets.end(),
+            [target](const CRefPtr<CThreadDelivery>& item) { return item.get() == target; }),
+            m_Targets.end());
+        m_IsDirty = true;
+    }
+
+    // bring sys.monitoring in line with the targets, only one thread calls
+    // set_events at a time and does it again if the targets changed meanwhile
+    void Sync()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+            if (m_IsSyncing || !m_IsDirty)
+            {
+                return;
+            }
+            m_IsSyncing = true;
+        }
+        while (true)
+        {
+            bool enable;
+            {
+                std::lock_guard<std::mutex> lock(m_Mtx);
+                enable = !m_Targets.empty();
+                m_IsDirty = false;
+                if (enable == m_IsEnabled)
+                {
+                    m_IsSyncing = false;
+                    return;
+                }
+                m_IsEnabled = enable;
+            }
+            CPyObjectHolder res = PyObject_CallMethod(
+                m_Monitoring, "set_events", "il", m_ToolId, enable ? m_Events : 0);
+            if (!res)
+            {
+                PyErr_WriteUnraisable(m_Monitoring);
+            }
+        }
+    }
+
+    // drop the deliveries of stopped injectors, their thread may be idle or gone
+    void Purge()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+            for (auto& target : m_Targets)
+            {
+                auto& pending = target->GetPending();
+                pending.erase(std::remove_if(pending.begin(), pending.end(),
+                    [](const CThreadDelivery::Item& item) { return !item.first->NeedsDelivery(item.second); }),
+                    pending.end());
+                target->SetPending(!pending.empty());
+            }
+            auto end = std::remove_if(m_Targets.begin(), m_Targets.end(),
+                [](const CRefPtr<CThreadDelivery>& target) { return !target->HasPending(); });
+            if (end == m_Targets.end())
+            {
+                return;
+            }
+            for (auto it = end; it != m_Targets.end(); ++it)
+            {
+                (*it)->SetTarget(false);
+            }
+            m_Targets.erase(end, m_Targets.end());
+            m_IsDirty = true;
+        }
+        Sync();
+    }
+
+    static PyObject* OnEvent(PyObject* self, PyObject* const* args, Py_ssize_t nargs)
+    {
+        auto hook = static_cast<CMonitorHook*>(PyCapsule_GetPointer(self, "MonitorHook"));
+        return hook->Dispatch(CThreadDelivery::Current());
+    }
+
+    PyObject* Dispatch(const CRefPtr<CThreadDelivery>& current)
+    {
+        static thread_local uint32_t misses = 0;
+        if (!current->HasPending())
+        {
+            if (++misses % PURGE_INTERVAL == 0)
+            {
+                Purge();
+            }
+            Py_RETURN_NONE;
+        }
+
+        std::vector<CThreadDelivery::Item> items;
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+            items = current->Take();
+            RemoveTarget(current.get());
+        }
+        Sync();
+
+        for (auto it = items.begin(); it != items.end(); ++it)
+        {
+            if (CLocalInjector::FastCall(it->first, it->second) != 0)
+            {
+                // deliver the rest on the next event of this thread
+                if (it + 1 != items.end())
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(m_Mtx);
+                        for (auto rest = it + 1; rest != items.end(); ++rest)
+                        {
+                            current->Push(rest->first, rest->second);
+                        }
+                        AddTarget(current);
+                    }
+                    Sync();
+                }
+                return nullptr;
+            }
+        }
+        Py_RETURN_NONE;
+    }
+
+private:
+    CPyObjectHolder m_Monitoring;
+    int m_ToolId;
+    long m_Events;
+    bool m_IsFailed;
+
+    std::mutex m_Mtx;
+    std::vector<CRefPtr<CThreadDelivery> > m_Targets;
+    bool m_IsEnabled;
+    bool m_IsSyncing;
+    bool m_IsDirty;
+};
+#endif // USE_SYS_MONITORING
+
+// state of one interpreter the module is loaded in. the checkers, the stats
+// and the delivery thread are shared by all of them, the delivery thread
+// enters an interpreter with a thread state of its own before delivering
+// there, so a subinterpreter with its own GIL gets its timeouts as well
+class CInterpreter : public CRefCounted<CInterpreter>
+{
+private:
+    struct CRegistry
+    {
+        std::mutex mtx;
+        std::vector<CRefPtr<CInterpreter> > interps;
+    };
+
+    CInterpreter(PyInterpreterState* state) : m_State(state),
+        m_IsMain(state == GetMainInterpreter()), m_IsAlive(true), m_Modules(0), m_IsEntered(false),
+        m_DeliveryState(nullptr), m_Ring(state)
+    {
+    }
+
+public:
+    // the live state of an interpreter, created on first use
+    static CRefPtr<CInterpreter> Get(PyInterpreterState* state)
+    {
+        auto& registry = Registry();
+        std::lock_guard<std::mutex> lock(registry.mtx);
+        for (auto& interp : registry.interps)
+        {
+            if (interp->m_State == state)
+            {
+                return interp;
+            }
+        }
+        registry.interps.emplace_back(new CInterpreter(state));
+        return registry.interps.back();
+    }
+
+    bool Is(PyInterpreterState* state) const
+    {
+        return m_State == state && IsAlive();
+    }
+
+    bool IsAlive() const
+    {
+        return m_IsAlive.load(std::memory_order_acquire);
+    }
+
+    bool IsMain() const
+    {
+        return m_IsMain;
+    }
+
+    // requires the GIL of this interpreter
+    CStackRing& GetRing()
+    {
+        return m_Ring;
+    }
+
+#ifdef USE_SYS_MONITORING
+    CMonitorHook& GetHook()
+    {
+        return m_Hook;
+    }
+#endif // USE_SYS_MONITORING
+
+#ifdef WITH_THREAD
+    // the delivery thread takes the GIL of this interpreter, false once it is
+    // going away. the main one is entered by the GIL state of the thread
+    bool Enter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+            if (!IsAlive())
+            {
+                return false;
+            }
+            m_IsEntered = true;
+        }
+        if (m_IsMain)
+        {
+            m_GILState = PyGILState_Ensure();
+        }
+        else
+        {
+            // only kept while delivering, an interpreter with another thread
+            // state can't be destroyed. the GIL is asked from a thread state of
+            // this interpreter, the one holding a shared GIL may only see
+            // the drop requests of its own
+            m_DeliveryState = PyThreadState_New(m_State);
+            PyEval_RestoreThread(m_DeliveryState);
+        }
+        if (!IsAlive())
+        {
+            Leave();
+            return false;
+        }
+        return true;
+    }
+
+    void Leave()
+    {
+        if (m_IsMain)
+        {
+            PyGILState_Release(m_GILState);
+        }
+        else
+        {
+            PyThreadState_Clear(m_DeliveryState);
+            PyThreadState_DeleteCurrent();
+            m_DeliveryState = nullptr;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+            m_IsEntered = false;
+        }
+        m_Cond.notify_all();
+    }
+#endif // WITH_THREAD
+
+#ifdef USE_ATFORK
+    // the delivery thread takes the lock of an interpreter without its GIL
+    static void BeforeFork()
+    {
+        auto& registry = Registry();
+        registry.mtx.lock();
+        for (auto& interp : registry.interps)
+        {
+            interp->m_Mtx.lock();
+        }
+    }
+
+    static void AfterFork(bool isChild)
+    {
+        auto& registry = Registry();
+        for (auto& interp : registry.interps)
+        {
+            if (isChild)
+            {
+                // the delivery thread is gone with the thread state it had
+                interp->m_IsEntered = false;
+                interp->m_DeliveryState = nullptr;
+                new (&interp->m_Cond) std::condition_variable();
+            }
+            interp->m_Mtx.unlock();
+        }
+        registry.mtx.unlock();
+    }
+#endif // USE_ATFORK
+
+    // a re-imported module shares the state of the one before, the state is
+    // closed with the last of them. requires the GIL
+    void AddModule()
+    {
+        ++m_Modules;
+    }
+
+    void ReleaseModule()
+    {
+        if (--m_Modules == 0)
+        {
+            Close();
+        }
+    }
+
+    // the interpreter is finalizing, requires its GIL. the delivery thread
+    // must not enter a subinterpreter that far in, so this also runs at exit
+    void Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+            if (!IsAlive())
+            {
+                return;
+            }
+            m_IsAlive.store(false, std::memory_order_release);
+        }
+        {
+            auto& registry = Registry();
+            std::lock_guard<std::mutex> lock(registry.mtx);
+            registry.interps.erase(std::remove_if(registry.interps.begin(), registry.interps.end(),
+                [this](const CRefPtr<CInterpreter>& interp) { return interp.get() == this; }),
+                registry.interps.end());
+        }
+#ifdef WITH_THREAD
+        if (!m_IsMain)
+        {
+            // the delivery thread may be waiting for this GIL
+            Py_BEGIN_ALLOW_THREADS
+            std::unique_lock<std::mutex> lock(m_Mtx);
+            m_Cond.wait(lock, [this]() { return !m_IsEntered; });
+            lock.unlock();
+            Py_END_ALLOW_THREADS
+        }
+#endif // WITH_THREAD
+        m_Ring.Clear();
+#ifdef USE_SYS_MONITORING
+        m_Hook.Clear();
+#endif // USE_SYS_MONITORING
+        CSiteRegistry::Instance().Release(this);
+    }
+
+private:
+    static CRegistry& Registry()
+    {
+        static CRegistry registry;
+        return registry;
+    }
+
+    PyInterpreterState* const m_State;
+    const bool m_IsMain;
+    std::atomic<bool> m_IsAlive;
+    // the loaded modules using it, see AddModule
+    size_t m_Modules;
+
+    // the delivery thread inside, guarded by m_Mtx
+    bool m_IsEntered;
+    std::mutex m_Mtx;
+    std::condition_variable m_Cond;
+    // the delivery thread's own while it is inside
+    PyThreadState* m_DeliveryState;
+#ifdef WITH_THREAD
+    PyGILState_STATE m_GILState;
+#endif // WITH_THREAD
+
+    CStackRing m_Ring;
+#ifdef USE_SYS_MONITORING
+    CMonitorHook m_Hook;
+#endif // USE_SYS_MONITORING
+};
+
+// the thread and its state are looked up once here instead of by every
+// injector, they use what their delivery has
+CThreadDelivery::CThreadDelivery(const CRefPtr<CInterpreter>& interp, PyThreadState* state) :
+    m_IsTarget(false), m_ThreadId(GetCurThreadId()), m_Checker(NextChecker()), m_Interp(interp),
+    // pending calls only run in the main interpreter
+    m_ThState(state, interp && interp->IsMain() && g_MainThreadId == m_ThreadId),
+    m_HasPending(false)
+{
+}
+
+CThreadDelivery::COwner& CThreadDelivery::Owner()
+{
+    static thread_local COwner owner;
+    return owner;
+}
+
+#ifdef USE_ATFORK
+void CThreadDelivery::ResetAfterFork()
+{
+    for (auto& delivery : Owner().deliveries)
+    {
+        delivery->m_Deadlines.Clear();
+    }
+}
+#endif // USE_ATFORK
+
+const CRefPtr<CThreadDelivery>& CThreadDelivery::Current()
+{
+    auto& deliveries = Owner().deliveries;
+    PyThreadState* state = GetThreadStateUnchecked();
+    if (!deliveries.empty() && (state == nullptr ||
+        (deliveries.back()->m_Interp && deliveries.back()->m_Interp->Is(::GetInterpreter(state)))))
+    {
+        // mostly a thread only ever runs in one interpreter
+        deliveries.back()->m_ThState.SetState(state);
+        return deliveries.back();
+    }
+    PyInterpreterState* interp = state != nullptr ? ::GetInterpreter(state) : nullptr;
+    for (auto it = deliveries.begin(); it != deliveries.end();)
+    {
+        auto& delivery = *it;
+        if (delivery->m_Interp && delivery->m_Interp->Is(interp))
+        {
+            std::swap(delivery, deliveries.back());
+            deliveries.back()->m_ThState.SetState(state);
+            return deliveries.back();
+        }
+        if (!delivery->m_Interp || !delivery->m_Interp->IsAlive())
+        {
+            // that interpreter is gone
+            delivery->m_Deadlines.Clear();
+            it = deliveries.erase(it);
+            continue;
+        }
+        ++it;
+    }
+    // first use in this interpreter, or without any thread state, e.g. the
+    // C API before the thread ever took the GIL
+    deliveries.emplace_back(new CThreadDelivery(
+        interp != nullptr ? CInterpreter::Get(interp) : nullptr, state));
+    return deliveries.back();
+}
+
+#ifdef WITH_THREAD
+#ifdef PENDING_CALL_NEEDS_SIGNAL
+// wakes the main thread for a pending call added from another thread. outside of
+// Windows it gets a real time signal nobody else handles, so that the signal
+// is received on the main thread itself
+class CMainWakeup
+{
+private:
+    CMainWakeup() : m_Signal(0)
+    {
+#if !defined(_WIN32) && defined(SIGRTMIN)
+        for (int sig = SIGRTMAX; sig >= SIGRTMIN; --sig)
+        {
+            struct sigaction action;
+            if (sigaction(sig, nullptr, &action) != 0 || (action.sa_flags & SA_SIGINFO) ||
+                action.sa_handler != SIG_DFL)
+            {
+                continue;
+            }
+            memset(&action, 0, sizeof(action));
+            sigemptyset(&action.sa_mask);
+            action.sa_handler = OnSignal;
+            // the system calls of the main thread go on
+            action.sa_flags = SA_RESTART;
+            if (sigaction(sig, &action, nullptr) == 0)
+            {
+                m_Signal = sig;
+                break;
+            }
+        }
+#endif
+    }
+
+public:
+    static CMainWakeup& Instance()
+    {
+        static CMainWakeup instance;
+        return instance;
+    }
+
+    // false if it can only wait for the main thread to take the GIL again
+    bool Wake()
+    {
+#ifdef _WIN32
+        _PyEval_SignalReceived(GetMainInterpreter());
+        return true;
+#elif defined(SIGRTMIN)
+        struct sigaction action;
+        // a handler may have been set over it since
+        if (m_Signal == 0 || sigaction(m_Signal, nullptr, &action) != 0 ||
+            (action.sa_flags & SA_SIGINFO) || action.sa_handler != OnSignal)
+        {
+            return false;
+        }
+        return pthread_kill((pthread_t)g_MainThreadId, m_Signal) == 0;
+#else
+        return false;
+#endif
+    }
+
+private:
+    static void OnSignal(int)
+    {
+        int err = errno;
+        _PyEval_SignalReceived(GetMainInterpreter());
+        errno = err;
+    }
+
+    int m_Signal;
+};
+#endif // PENDING_CALL_NEEDS_SIGNAL
+
+class CAttacher
+{
+private:
+    using Item = CInjectorQueue::Item;
+
+    CAttacher() : m_Appended(false), m_IsQuit(false), m_IsNudged(false)
+    {
+    }
+
+public:
+    ~CAttacher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+            m_IsQuit = true;
+        }
+        m_Cond.notify_all();
+        if (m_DeliverTh.joinable())
+        {
+            m_DeliverTh.join();
+        }
+    }
+
+    static CAttacher& Instance()
+    {
+        static CAttacher instance;
+        return instance;
+    }
+
+    static void Attach(const CInjectorPtr& injector, uint32_t gen)
+    {
+        if (injector->IsMainThreadInjector() && !injector->IsDetached())
+        {
+            Instance().InjectMain(injector, gen);
+        }
+        else
+        {
+            // the delivery thread waits for the GIL so that the checker never does
+            Instance().Deliver(injector, gen);
+        }
+    }
+
+    // return false if the main thread requests are still waiting for a pending call slot
+    bool Flush()
+    {
+        if (m_MainQueue.Empty())
+        {
+            return true;
+        }
+        return SchedulePending();
+    }
+
+#ifdef USE_ATFORK
+    // the delivery thread only holds the lock to take the queues
+    void BeforeFork()
+    {
+        m_Mtx.lock();
+        m_MainQueue.BeforeFork();
+    }
+
+    // the child drops the timeouts that weren't delivered yet, its
+    // delivery thread is started again on the next one
+    void AfterFork(bool isChild)
+    {
+        m_MainQueue.AfterFork(isChild);
+        if (isChild)
+        {
+            new (&m_DeliverTh) std::thread();
+            new (&m_Cond) std::condition_variable();
+            m_Queue.clear();
+            m_HardQueue.clear();
+            m_IsNudged = false;
+            // a pending call of the parent may not run in the child
+            m_Appended = false;
+        }
+        m_Mtx.unlock();
+    }
+#endif // USE_ATFORK
+
+protected:
+    // expired main thread injectors share a single pending call, so a burst of
+    // them takes one slot of the small pending call ring instead of one each
+    void InjectMain(const CInjectorPtr& injector, uint32_t gen)
+    {
+        m_MainQueue.Push(injector, gen);
+        SchedulePending();
+    }
+
+    bool SchedulePending()
+    {
+        if (m_Appended.exchange(true))
+        {
+            return true;
+        }
+        if (Py_AddPendingCall(OnMainCall, this) != 0)
+        {
+            // the ring is full, the checker retries with Flush
+            CStats::Instance().Add(CStats::PENDING_CALL_FAILED);
+            m_Appended = false;
+            return false;
+        }
+#ifdef PENDING_CALL_NEEDS_SIGNAL
+        if (!CMainWakeup::Instance().Wake())
+        {
+            // let the delivery thread take the GIL once, the main thread
+            // recomputes its eval breaker when it takes the GIL back
+            Nudge();
+        }
+#endif // PENDING_CALL_NEEDS_SIGNAL
+        return true;
+    }
+
+    static int OnMainCall(void* arg)
+    {
+        auto attacher = static_cast<CAttacher*>(arg);
+        // requests pushed from now on schedule another call
+        attacher->m_Appended = false;
+        return attacher->HandleMain();
+    }
+
+    int HandleMain()
+    {
+        while (true)
+        {
+            auto item = m_MainQueue.Pop();
+            if (item.first.get() == nullptr)
+            {
+                return 0;
+            }
+            if (CLocalInjector::FastCall(item.first, item.second) != 0)
+            {
+                // the exception propagates from here, leave the rest to another call
+                if (!m_MainQueue.Empty())
+                {
+                    SchedulePending();
+                }
+                return -1;
+            }
+        }
+    }
+
+    void Deliver(const CInjectorPtr& injector, uint32_t gen)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+            if (!m_DeliverTh.joinable())
+            {
+                m_DeliverTh = std::thread(
+                    std::bind(&CAttacher::DeliverThread, this));
+            }
+            m_Queue.emplace_back(injector, gen);
+        }
+        m_Cond.notify_one();
+    }
+
+#ifdef PENDING_CALL_NEEDS_SIGNAL
+    void Nudge()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+            if (!m_DeliverTh.joinable())
+            {
+                m_DeliverTh = std::thread(
+                    std::bind(&CAttacher::DeliverThread, this));
+            }
+            m_IsNudged = true;
+        }
+        m_Cond.notify_one();
+    }
+#endif // PENDING_CALL_NEEDS_SIGNAL
+
+public:
+    // the exception of a hard deadline needs the GIL as well
+    void RaiseHard(const CInjectorPtr& injector, uint32_t gen)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+            if (!m_DeliverTh.joinable())
+            {
+                m_DeliverTh = std::thread(
+                    std::bind(&CAttacher::DeliverThread, this));
+            }
+            m_HardQueue.emplace_back(injector, gen);
+        }
+        m_Cond.notify_one();
+    }
+
+protected:
+
+    // the timeouts for one interpreter, delivered under its GIL
+    struct CGroup
+    {
+        CInterpreter* interp;
+        std::vector<Item> items;
+        std::vector<Item> hardItems;
+    };
+
+    void DeliverThread()
+    {
+        std::vector<Item> items;
+        std::vector<Item> hardItems;
+        std::vector<CGroup> groups;
+        std::unique_lock<std::mutex> lock(m_Mtx);
+        while (!m_IsQuit)
+        {
+            m_Cond.wait(lock, [this]()
+                {
+                    return m_IsQuit || m_IsNudged || !m_Queue.empty() || !m_HardQueue.empty();
+                });
+            items.swap(m_Queue);
+            hardItems.swap(m_HardQueue);
+            bool isNudged = m_IsNudged;
+            m_IsNudged = false;
+            lock.unlock();
+            if (isNudged)
+            {
+                auto waitStart = ClockType::now();
+                CGILHolder gil;
+                RecordGILWait(waitStart);
+            }
+            for (auto& item : items)
+            {
+                FindGroup(groups, item).items.push_back(std::move(item));
+            }
+            for (auto& item : hardItems)
+            {
+                FindGroup(groups, item).hardItems.push_back(std::move(item));
+            }
+            // mostly only the main interpreter
+            for (auto& group : groups)
+            {
+                DeliverGroup(group);
+            }
+            items.clear();
+            hardItems.clear();
+            groups.clear();
+            lock.lock();
+        }
+    }
+
+    static void RecordGILWait(std::chrono::time_point<ClockType> waitStart)
+    {
+        CStats::Instance().Add(CStats::GIL_WAITS);
+        CStats::Instance().AddDuration(CStats::GIL_WAIT_TOTAL_NS, CStats::GIL_WAIT_MAX_NS,
+            ClockType::now() - waitStart);
+    }
+
+    static CGroup& FindGroup(std::vector<CGroup>& groups, const Item& item)
+    {
+        CInterpreter* interp = item.first->GetDelivery()->GetInterpreter().get();
+        for (auto& group : groups)
+        {
+            if (group.interp == interp)
+            {
+                return group;
+            }
+        }
+        groups.push_back(CGroup{ interp });
+        return groups.back();
+    }
+
+    static void DeliverGroup(CGroup& group)
+    {
+        auto waitStart = ClockType::now();
+        // the items may all be handed over before it is left
+        CRefPtr<CInterpreter> interp(group.interp);
+        if (!interp->Enter())
+        {
+            // it's going away, so are its threads
+            return;
+        }
+        RecordGILWait(waitStart);
+        std::vector<CBatchEntry> entries;
+        {
+            CSinkBatch batch;
+            for (auto& item : group.items)
+            {
+                if (item.first->HasSink())
+                {
+                    batch.Add(item.first, item.second);
+                }
+                else if (item.first->IsCapture())
+                {
+                    interp->GetRing().Capture(item.first, item.second);
+                }
+                else
+                {
+                    entries.push_back(CBatchEntry{ item.first->GetDelivery().get(),
+                        item.first->LoadDeadline(), std::move(item) });
+                }
+            }
+            batch.Flush();
+        }
+        InjectBatches(entries);
+        for (auto& item : group.hardItems)
+        {
+            item.first->RaiseHard(item.second);
+        }
+        interp->Leave();
+    }
+
+    struct CBatchEntry
+    {
+        CThreadDelivery* target;
+        // read once, the owner may arm it again while this is sorted
+        std::chrono::time_point<ClockType> deadline;
+        Item item;
+    };
+
+    // a stall can expire many guards of a thread at once, every thread gets a
+    // single hand over with its timeouts in deadline order
+    static void InjectBatches(std::vector<CBatchEntry>& entries)
+    {
+        std::sort(entries.begin(), entries.end(),
+            [](const CBatchEntry& lhs, const CBatchEntry& rhs)
+            {
+                return lhs.target != rhs.target ? std::less<CThreadDelivery*>()(lhs.target, rhs.target) :
+                    lhs.deadline < rhs.deadline;
+            });
+        std::vector<Item> items;
+        for (auto it = entries.begin(); it != entries.end(); )
+        {
+            auto target = it->target;
+            for (; it != entries.end() && it->target == target; ++it)
+            {
+                items.push_back(std::move(it->item));
+            }
+            Inject(items);
+            items.clear();
+        }
+    }
+
+    static void Inject(std::vector<Item>& items)
+    {
+#ifdef USE_SYS_MONITORING
+        auto& delivery = items.front().first->GetDelivery();
+        if (delivery->GetInterpreter()->GetHook().Arm(delivery, items))
+        {
+            return;
+        }
+#ifdef Py_GIL_DISABLED
+        // swapping in the state of a running thread is not safe without the GIL,
+        // there is no way left to deliver these, say so once rather than never
+        static std::atomic<bool> isWarned(false);
+        if (!isWarned.exchange(true) && PyErr_WarnEx(PyExc_RuntimeWarning,
+            "xtimeout: the sys.monitoring tool isn't available, timeouts of threads "
+            "other than the main one are dropped", 1) != 0)
+        {
+            PyErr_WriteUnraisable(nullptr);
+        }
+        return;
+#endif // Py_GIL_DISABLED
+        // fall back to the trace hook if the tool can't be registered
+#endif // USE_SYS_MONITORING
+        CLocalInjector::Call(std::move(items));
+    }
+
+private:
+    CInjectorQueue m_MainQueue;
+    std::atomic<bool> m_Appended;
+
+    std::thread m_DeliverTh;
+    bool m_IsQuit;
+    // take the GIL once for the main thread, see SchedulePending
+    bool m_IsNudged;
+    std::mutex m_Mtx;
+    std::condition_variable m_Cond;
+    std::vector<Item> m_Queue;
+    std::vector<Item> m_HardQueue;
+};
+
+#else
+class CAttacher
+{
+private:
+    CAttacher() : m_Appended(false)
+    {
+    }
+
+public:
+    static CAttacher& Instance()
+    {
+        static CAttacher instance;
+        return instance;
+    }
+
+    static void Attach(const CInjectorPtr& injector, uint32_t gen)
+    {
+        Instance().InjectRequest(injector, gen);
+    }
+
+    void RaiseHard(const CInjectorPtr& injector, uint32_t gen)
+    {
+        m_HardQueue.Push(injector, gen);
+        InjectRequest(nullptr, 0);
+    }
+
+    bool Flush()
+    {
+        if ((m_Queue.Empty() && m_HardQueue.Empty()) || m_Appended)
+        {
+            return true;
+        }
+        m_Appended = true;
+        if (Py_AddPendingCall(OnCall, this) != 0)
+        {
+            CStats::Instance().Add(CStats::PENDING_CALL_FAILED);
+            m_Appended = false;
+            return false;
+        }
+        return true;
+    }
+
+protected:
+    static int OnCall(void* arg)
+    {
+        auto attacher = static_cast<CAttacher*>(arg);
+        attacher->Handle();
+        attacher->m_Appended = false;
+        attacher->Handle();
+        return 0;
+    }
+
+    bool InjectRequest(const CInjectorPtr& injector, uint32_t gen)
+    {
+        m_Queue.Push(injector, gen);
+        // state: handling; ok
+        // state: handled, appended set; ok
+        // state: handled, before set appended; fail => need handle again
+        if (m_Appended)
+        {
+            return true;
+        }
+        m_Appended = true;
+        if (Py_AddPendingCall(OnCall, this) != 0)
+        {
+            // the checker retries with Flush
+            CStats::Instance().Add(CStats::PENDING_CALL_FAILED);
+            m_Appended = false;
+            return false;
+        }
+        return true;
+    }
+
+    void Handle()
+    {
+        while (!m_HardQueue.Empty())
+        {
+            auto item = m_HardQueue.Pop();
+            if (item.first)
+            {
+                item.first->RaiseHard(item.second);
+            }
+        }
+        CSinkBatch batch;
+        std::vector<CInjectorQueue::Item> items;
+        while (!m_Queue.Empty())
+        {
+            auto item = m_Queue.Pop();
+            if (item.first.get() == nullptr)
+            {
+                continue;
+            }
+            if (item.first->HasSink())
+            {
+                batch.Add(item.first, item.second);
+            }
+            else if (item.first->IsCapture())
+            {
+                item.first->GetDelivery()->GetInterpreter()->GetRing().Capture(item.first, item.second);
+            }
+            else
+            {
+                items.push_back(std::move(item));
+            }
+        }
+        // without threads every timeout is for this one, run them by the same hook
+        if (!items.empty())
+        {
+            CLocalInjector::Call(std::move(items));
+        }
+    }
+
+private:
+    CInjectorQueue m_Queue;
+    CInjectorQueue m_HardQueue;
+    std::atomic<bool> m_Appended;
+};
+
+#endif // WITH_THREAD
+
+// one checker shard, every shard has its own thread, heap and wakeup.
+// injectors go to the shard of the thread that created them
+class CContextHelper
+{
+private:
+    using TimePoint = std::chrono::time_point<ClockType>;
+
+    // shards are created on first use and live until exit
+    struct CShards
+    {
+        CShards()
+        {
+            // construct the attacher first so that it outlives the checker threads
+            CAttacher::Instance();
+            for (auto& slot : slots)
+            {
+                slot.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        ~CShards()
+        {
+            for (auto& slot : slots)
+            {
+                delete slot.load(std::memory_order_relaxed);
+            }
+        }
+
+        static CShards& Instance()
+        {
+            static CShards instance;
+            return instance;
+        }
+
+        CContextHelper& Create(uint32_t index)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            CContextHelper* shard = slots[index].load(std::memory_order_relaxed);
+            if (shard == nullptr)
+            {
+                shard = new CContextHelper();
+                slots[index].store(shard, std::memory_order_release);
+            }
+            return *shard;
+        }
+
+        std::atomic<CContextHelper*> slots[MAX_CHECKERS];
+        std::mutex mtx;
+    };
+
+    CContextHelper() :
+        m_IsStarted(false), m_IsQuit(false),
+        m_NextDeadline(TimePoint::max().time_since_epoch().count()),
+        m_CompactSize(MIN_COMPACT_SIZE)
+    {
+    }
+
+public:
+    ~CContextHelper()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mtx);
+            m_IsQuit = true;
+        }
+        m_Waiter.WakeUp();
+        if (m_CheckTh.joinable())
+        {
+            m_CheckTh.join();
+        }
+        while (auto node = m_Requests.Pop())
+        {
+            static_cast<CLocalInjector*>(node)->m_QueuedRef = nullptr;
+        }
+    }
+
+#ifdef USE_ATFORK
+    // a fork waits for the running sweeps, the child drops the timers of the
+    // parent and starts its checkers on the first start()
+    static void BeforeFork()
+    {
+        auto& shards = CShards::Instance();
+        shards.mtx.lock();
+        for (auto& slot : shards.slots)
+        {
+            CContextHelper* shard = slot.load(std::memory_order_relaxed);
+            if (shard != nullptr)
+            {
+                shard->m_Mtx.lock();
+            }
+        }
+    }
+
+    static void AfterFork(bool isChild)
+    {
+        auto& shards = CShards::Instance();
+        for (auto& slot : shards.slots)
+        {
+            CContextHelper* shard = slot.load(std::memory_order_relaxed);
+            if (shard == nullptr)
+            {
+                continue;
+            }
+            if (isChild)
+            {
+                shard->ResetAfterFork();
+            }
+            shard->m_Mtx.unlock();
+        }
+        shards.mtx.unlock();
+    }
+#endif // USE_ATFORK
+
+    static CContextHelper& For(const CInjectorPtr& pInjector)
+    {
+        uint32_t index = pInjector->GetDelivery()->GetChecker();
+        CContextHelper* shard = CShards::Instance().slots[index].load(std::memory_order_acquire);
+        return shard != nullptr ? *shard : CShards::Instance().Create(index);
+    }
+
+    void Start(const CInjectorPtr& pInjector)
+    {
+        if (!m_IsStarted.load(std::memory_order_acquire))
+        {
+            StartCheckThread();
+        }
+        if (pInjector->IsInheriting() && pInjector->GetDelivery()->IsCurrentThread())
+        {
+            pInjector->Inherit(pInjector->GetDelivery()->GetDeadlines().GetBudget(pInjector.get()));
+        }
+        uint32_t gen = pInjector->Arm();
+        if (IsStackable(pInjector))
+        {
+            CInjectorPtr publish = pInjector->GetDelivery()->GetDeadlines().Push(pInjector, gen);
+            if (publish)
+            {
+                Publish(publish);
+            }
+            return;
+        }
+        Publish(pInjector);
+    }
+
+    void Stop(const CInjectorPtr& pInjector)
+    {
+        uint32_t gen = pInjector->m_Generation.load(std::memory_order_relaxed);
+        // the stale heap entry is dropped when it reaches the top or on compaction
+        pInjector->Disarm();
+        if ((gen & 1) && pInjector->GetSiteId() != 0)
+        {
+            CSiteRegistry::Instance().Record(pInjector->GetSiteId(), pInjector->GetElapsed());
+        }
+        if ((gen & 1) && pInjector->IsStackedAt(gen) && IsStackable(pInjector))
+        {
+            CInjectorPtr publish = pInjector->GetDelivery()->GetDeadlines().Remove(pInjector.get());
+            if (publish)
+            {
+                Publish(publish);
+            }
+        }
+    }
+
+    // hand an armed injector over to the checker
+    void Publish(const CInjectorPtr& pInjector)
+    {
+        auto deadline = pInjector->m_Deadline.load(std::memory_order_relaxed);
+        // an injector is queued at most once, the checker reads its latest arming when popping it
+        if (!pInjector->m_IsQueued.exchange(true, std::memory_order_acq_rel))
+        {
+            pInjector->m_QueuedRef = pInjector;
+            m_Requests.Push(pInjector.get());
+        }
+        // the checker only needs to know about a deadline earlier than the one it waits for
+        if (deadline < m_NextDeadline.load(std::memory_order_seq_cst))
+        {
+            m_Waiter.WakeUp();
+        }
+    }
+
+protected:
+    // only the owner thread touches its stack, detached injectors never
+    // report back to it. a watchdog's deadline moves without the stack knowing,
+    // and without a callback the thread never sees its deadline fire
+    static bool IsStackable(const CInjectorPtr& pInjector)
+    {
+        return !pInjector->IsDetached() && !pInjector->IsWatchdog() &&
+            pInjector->HasCallback() && pInjector->GetDelivery()->IsCurrentThread();
+    }
+
+    void StartCheckThread()
+    {
+        std::lock_guard<std::mutex> lock(m_Mtx);
+        if (!m_CheckTh.joinable())
+        {
+            m_IsQuit = false;
+            m_CheckTh = std::thread(
+                std::bind(&CContextHelper::CheckThread, this));
+        }
+        m_IsStarted.store(true, std::memory_order_release);
+    }
+
+#ifdef USE_ATFORK
+    void ResetAfterFork()
+    {
+        // the thread is gone, its handle can't be joined
+        new (&m_CheckTh) std::thread();
+        m_IsStarted.store(false, std::memory_order_relaxed);
+        m_IsQuit.store(false, std::memory_order_relaxed);
+        m_Waiter.ResetAfterFork();
+        m_NextDeadline.store(TimePoint::max().time_since_epoch().count(), std::memory_order_relaxed);
+        while (auto node = m_Requests.Pop())
+        {
+            auto injector = std::move(static_cast<CLocalInjector*>(node)->m_QueuedRef);
+            injector->m_IsQueued.store(false, std::memory_order_relaxed);
+        }
+        m_Requests.Reset();
+        // the checker has reported all of them by the end of its sweep
+        size_t removed = m_Timers.RemoveIf([](uint32_t, const CInjectorPtr&) { return true; });
+        CStats::Instance().AddTimers(-static_cast<int64_t>(removed));
+        m_CompactSize = MIN_COMPACT_SIZE;
+    }
+#endif // USE_ATFORK
+
+    void CheckThread()
+    {
+        bool highResolution = false;
+#ifdef __linux__
+        // the default 50us slack would be added to every timed wait of the checker
+        prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+#endif // __linux__
+        auto& stats = CStats::Instance();
+        size_t reported = 0;
+        while (!m_IsQuit)
+        {
+            // held over a sweep, a fork waits for it to finish
+            std::unique_lock<std::mutex> lock(m_Mtx);
+            auto busyStart = ClockType::now();
+            stats.Add(CStats::CHECKER_WAKEUPS);
+            Merge();
+            Expire();
+            stats.AddTimers(static_cast<int64_t>(m_Timers.Size()) - static_cast<int64_t>(reported));
+            reported = m_Timers.Size();
+            bool flushed = CAttacher::Instance().Flush();
+            SetHighResolution(highResolution, !m_Timers.Empty() || !flushed);
+
+            auto nextDeadline = m_Timers.Empty() ? TimePoint::max() : m_Timers.TopDeadline();
+            if (!flushed)
+            {
+                nextDeadline = std::min(nextDeadline, ClockType::now() + PENDING_RETRY_INTERVAL);
+            }
+            m_NextDeadline.store(nextDeadline.time_since_epoch().count(), std::memory_order_seq_cst);
+            // a producer either sees the published deadline or its request is seen here
+            stats.Add(CStats::CHECKER_BUSY_NS, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                ClockType::now() - busyStart).count());
+            lock.unlock();
+            if (!m_Requests.Empty())
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            m_Waiter.Wait(nextDeadline);
+        }
+        stats.AddTimers(-static_cast<int64_t>(reported));
+        SetHighResolution(highResolution, false);
+    }
+
+    void Expire()
+    {
+        auto now = ClockType::now();
+        while (!m_Timers.Empty())
+        {
+            // a stopped one on top is dropped early, the checker won't wake up for it
+            bool isArmed = m_Timers.TopInjector()->IsArmed(m_Timers.TopGeneration());
+            if (isArmed && m_Timers.TopDeadline() > now)
+            {
+                break;
+            }
+            auto entry = m_Timers.Pop();
+            auto deadline = entry.deadline;
+            if (isArmed)
+            {
+                deadline = entry.injector->LoadDeadline();
+                if (entry.isHard)
+                {
+                    deadline += entry.injector->GetHardDelay();
+                }
+            }
+            if (deadline > entry.deadline)
+            {
+                // a watchdog heartbeat moved it, look again then
+                CStats::Instance().Add(CStats::RESCHEDULED);
+                entry.deadline = deadline;
+                m_Timers.Push(std::move(entry));
+                continue;
+            }
+            if (entry.isHard)
+            {
+                CStats::Instance().Add(isArmed ? CStats::EXPIRED : CStats::CANCELLED);
+                if (isArmed)
+                {
+                    CAttacher::Instance().RaiseHard(entry.injector, entry.generation);
+                }
+            }
+            else if (isArmed || entry.injector->IsStackedAt(entry.generation))
+            {
+                CStats::Instance().Add(CStats::EXPIRED);
+                entry.injector->SetExpired(entry.generation);
+                if (entry.injector->HasCallback())
+                {
+                    CAttacher::Attach(entry.injector, entry.generation);
+                }
+                else
+                {
+                    entry.injector->CallNative(entry.generation);
+                }
+                if (isArmed && entry.injector->HasHardDeadline())
+                {
+                    entry.deadline += entry.injector->GetHardDelay();
+                    entry.isHard = true;
+                    m_Timers.Push(std::move(entry));
+                }
+            }
+            else
+            {
+                CStats::Instance().Add(CStats::CANCELLED);
+            }
+            if (m_IsQuit)
+            {
+                break;
+            }
+        }
+    }
+
+    void Merge()
+    {
+        while (auto node = m_Requests.Pop())
+        {
+            auto injector = std::move(static_cast<CLocalInjector*>(node)->m_QueuedRef);
+            // any arming after this point pushes the injector again
+            injector->m_IsQueued.exchange(false, std::memory_order_acq_rel);
+            uint32_t gen = injector->m_Generation.load(std::memory_order_acquire);
+            if (!(gen & 1))
+            {
+                // stopped by another thread, its owner may still have to hear about it
+                gen = injector->m_StackedGen.load(std::memory_order_acquire);
+            }
+            CStats::Instance().Add(CStats::MERGED);
+            // it maybe stopped already
+            if (!(gen & 1) || !injector->NeedsDelivery(gen))
+            {
+                CStats::Instance().Add(CStats::CANCELLED);
+                continue;
+            }
+            auto deadline = TimePoint(ClockType::duration(
+                injector->m_Deadline.load(std::memory_order_relaxed)));
+            m_Timers.Push(CTimerHeap::CEntry{ deadline, gen, std::move(injector), false });
+        }
+
+        if (m_Timers.Size() < m_CompactSize)
+        {
+            return;
+        }
+        size_t removed = m_Timers.RemoveIf([](uint32_t gen, const CInjectorPtr& injector)
+        {
+            return !injector->NeedsDelivery(gen);
+        });
+        CStats::Instance().Add(CStats::CANCELLED, removed);
+        m_CompactSize = std::max(MIN_COMPACT_SIZE, m_Timers.Size() * 2);
+    }
+
+    static void SetHighResolution(bool& current, bool enable)
+    {
+        if (current == enable)
+        {
+            return;
+        }
+        current = enable;
+#ifdef WIN32
+        if (enable)
+        {
+            timeBeginPeriod(1);
+        }
+        else
+        {
+            timeEndPeriod(1);
+        }
+#endif // WIN32
+    }
+
+private:
+    std::thread m_CheckTh;
+    std::atomic<bool> m_IsStarted;
+    std::atomic<bool> m_IsQuit;
+    // guards starting the thread and its sweeps
+    std::mutex m_Mtx;
+    CWaiter m_Waiter;
+    // deadline the checker sleeps for, in ClockType ticks
+    std::atomic<ClockType::rep> m_NextDeadline;
+    CMpscQueue m_Requests;
+
+    // owned by the checker thread
+    CTimerHeap m_Timers;
+    size_t m_CompactSize;
+};
+
+// called on the owner thread before a timeout runs, so that the deadlines its
+// injector covered are published and may fire inside the callback as before
+static void OnDeadlineDelivered(const CInjectorPtr& injector, uint32_t gen)
+{
+    if (!injector->IsStackedAt(gen) || !injector->GetDelivery()->IsCurrentThread())
+    {
+        return;
+    }
+    CInjectorPtr publish = injector->GetDelivery()->GetDeadlines().OnDelivered(injector.get(), gen);
+    if (publish)
+    {
+        CContextHelper::For(publish).Publish(publish);
+    }
+}
+
+#ifdef USE_ATFORK
+// a forked child only has the forking thread, the locks the other threads
+// may take without the GIL are held over the fork, so the child gets them
+// free and the state they guard whole. the armed timers of the parent are
+// dropped, its checkers and delivery thread start again when used
+static void BeforeFork()
+{
+    CContextHelper::BeforeFork();
+#ifdef WITH_THREAD
+    CAttacher::Instance().BeforeFork();
+    CInterpreter::BeforeFork();
+#endif // WITH_THREAD
+    CSiteRegistry::Instance().BeforeFork();
+}
+
+static void AfterForkInParent()
+{
+    CSiteRegistry::Instance().AfterFork();
+#ifdef WITH_THREAD
+    CInterpreter::AfterFork(false);
+    CAttacher::Instance().AfterFork(false);
+#endif // WITH_THREAD
+    CContextHelper::AfterFork(false);
+}
+
+static void AfterForkInChild()
+{
+    PyThreadState* state = GetThreadStateUnchecked();
+    if (state != nullptr && GetInterpreter(state) == GetMainInterpreter())
+    {
+        // the forking thread is the main thread of the child
+        g_MainThreadId = GetCurThreadId();
+    }
+    CSiteRegistry::Instance().AfterFork();
+#ifdef WITH_THREAD
+    CInterpreter::AfterFork(true);
+    CAttacher::Instance().AfterFork(true);
+#endif // WITH_THREAD
+    CContextHelper::AfterFork(true);
+    CThreadDelivery::ResetAfterFork();
+}
+#endif // USE_ATFORK
+
+
+struct PyInjector
+{
+    PyObject_HEAD;
+    CInjectorPtr injector;
 };
 
 
 static void DeallocPyInjector(PyInjector* self)
 {
-    if (!self->injector)
+    if (self->injector)
     {
-        return;
+        self->injector->Release();
+    }
+    self->injector.~CInjectorPtr();
+    PyTypeObject* type = Py_TYPE(self);
+    type->tp_free(reinterpret_cast<PyObject*>(self));
+#if (PY_VERSION_HEX >= 0x03080000)
+    // instances of heap types hold a reference to it
+    Py_DECREF(type);
+#endif
+}
+
+// milliseconds, an int as before or a float for sub-millisecond timeouts
+static bool ParseDuration(PyObject* obj, std::chrono::nanoseconds& duration)
+{
+    double millisec;
+    if (PyFloat_Check(obj))
+    {
+        millisec = PyFloat_AS_DOUBLE(obj);
+    }
+    else if (PyIndex_Check(obj))
+    {
+        CPyObjectHolder index = PyNumber_Index(obj);
+        if (!index)
+        {
+            return false;
+        }
+        int overflow;
+        long long value = PyLong_AsLongLongAndOverflow(index, &overflow);
+        if (value == -1 && PyErr_Occurred())
+        {
+            return false;
+        }
+        if (overflow != 0 || value < 0 || value > static_cast<long long>(MAX_TIMEOUT_MS))
+        {
+            PyErr_SetString(PyExc_ValueError, "time out of range");
+            return false;
+        }
+        duration = std::chrono::milliseconds(value);
+        return true;
+    }
+    else
+    {
+        PyErr_Format(PyExc_TypeError, "time must be int or float milliseconds, not %.200s",
+            Py_TYPE(obj)->tp_name);
+        return false;
+    }
+    // also rejects nan
+    if (!(millisec >= 0 && millisec <= MAX_TIMEOUT_MS))
+    {
+        PyErr_SetString(PyExc_ValueError, "time out of range");
+        return false;
     }
-    self->injector->Release();
-    self->injector = nullptr;
+    duration = std::chrono::nanoseconds(static_cast<long long>(millisec * 1e6 + 0.5));
+    return true;
 }
 
 static int InitPyInjector(PyInjector* self, PyObject *args, PyObject *kwds)
 {
+    static const char* kwlist[] = { "time", "callback", "sink", "capture", "site", "watchdog",
+        "hard", "exception", "inherit", nullptr };
+    PyObject* pyTime;
     PyObject* callback;
-    uint32_t time;
-    if (!PyArg_ParseTuple(args, "IO", &time, &callback))
+    PyObject* sink = Py_None;
+    int capture = 0;
+    PyObject* site = Py_None;
+    int watchdog = 0;
+    PyObject* pyHard = Py_None;
+    PyObject* exception = PyExc_TimeoutError;
+    int inherit = 0;
+    std::chrono::nanoseconds time;
+    std::chrono::nanoseconds hard(0);
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|OpOpOOp", const_cast<char**>(kwlist),
+        &pyTime, &callback, &sink, &capture, &site, &watchdog, &pyHard, &exception, &inherit))
+    {
+        return -1;
+    }
+    if (capture && sink != Py_None)
+    {
+        PyErr_SetString(PyExc_ValueError, "an injector can't both capture and have a sink");
+        return -1;
+    }
+#ifdef Py_GIL_DISABLED
+    if (capture)
+    {
+        // the frames of a running thread can't be read without the GIL
+        PyErr_SetString(PyExc_NotImplementedError, "capture needs the GIL");
+        return -1;
+    }
+#endif // Py_GIL_DISABLED
+    if (!ParseDuration(pyTime, time))
+    {
+        return -1;
+    }
+    if (pyHard != Py_None)
+    {
+        if (!ParseDuration(pyHard, hard))
+        {
+            return -1;
+        }
+        if (hard < time)
+        {
+            PyErr_SetString(PyExc_ValueError, "hard must not be shorter than time");
+            return -1;
+        }
+        if (!PyExceptionClass_Check(exception))
+        {
+            PyErr_SetString(PyExc_TypeError, "exception must be an exception class");
+            return -1;
+        }
+        if (sink != Py_None || capture)
+        {
+            PyErr_SetString(PyExc_ValueError, "a hard deadline is raised in the starting thread, "
+                "it can't be used with a sink or capture");
+            return -1;
+        }
+    }
+    else if (callback == Py_None && !capture)
+    {
+        PyErr_SetString(PyExc_TypeError, "callback can only be None with a hard deadline or capture");
+        return -1;
+    }
+    if (sink != Py_None && !PyCallable_Check(sink))
     {
+        PyErr_SetString(PyExc_TypeError, "sink must be callable");
         return -1;
     }
-    self->injector = std::make_shared<CLocalInjector>();
-    self->injector->SetCallback(callback);
+    if (self->injector)
+    {
+        self->injector->Release();
+    }
+    self->injector = CInjectorPtr(new CLocalInjector());
+    // the callback of a capture is its tag, None included
+    self->injector->SetCallback(callback != Py_None || capture ? callback : nullptr);
+    self->injector->SetSink(sink != Py_None ? sink : nullptr);
+    self->injector->SetCapture(capture != 0);
+    self->injector->SetWatchdog(watchdog != 0);
+    self->injector->SetInherit(inherit != 0);
+    if (pyHard != Py_None)
+    {
+        self->injector->SetHardDeadline(exception,
+            std::chrono::duration_cast<ClockType::duration>(hard - time));
+    }
+    if (site != Py_None)
+    {
+        self->injector->SetSiteId(CSiteRegistry::Instance().Register(
+            site, self->injector->GetDelivery()->GetInterpreter().get()));
+    }
     self->injector->SetDuration(time);
     return 0;
 }
@@ -795,7 +4714,11 @@ static int InitPyInjector(PyInjector* self, PyObject *args, PyObject *kwds)
 static PyObject* PyInjectorNew(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
     PyInjector* self = reinterpret_cast<PyInjector*>(type->tp_alloc(type, 0));
-    self->injector = nullptr;
+    if (self == nullptr)
+    {
+        return nullptr;
+    }
+    new (&self->injector) CInjectorPtr();
     return reinterpret_cast<PyObject*>(self);
 }
 
@@ -803,128 +4726,457 @@ static PyObject* InjectorStart(PyObject* self, PyObject* args)
 {
     auto pyInjector = reinterpret_cast<PyInjector*>(self);
     auto& injector = pyInjector->injector;
-    injector->RecordStartTime();
-    CContextHelper::Instance().Start(injector);
+    CContextHelper::For(injector).Start(injector);
     Py_RETURN_NONE;
 }
 
 static PyObject* InjectorStop(PyObject* self, PyObject* args)
 {
     auto pyInjector = reinterpret_cast<PyInjector*>(self);
-    CContextHelper::Instance().Stop(pyInjector->injector);
+    CContextHelper::For(pyInjector->injector).Stop(pyInjector->injector);
     Py_RETURN_NONE;
 }
 
 static PyObject* InjectorReset(PyObject* self)
+{
+    auto& injector = reinterpret_cast<PyInjector*>(self)->injector;
+    // a watchdog heartbeat is a single store while its arming hasn't expired
+    if (injector->IsWatchdog() && injector->Beat())
+    {
+        Py_RETURN_NONE;
+    }
+    // re-arm in place, the previous arming becomes stale
+    return InjectorStart(self, nullptr);
+}
+
+static PyObject* InjectorEnter(PyObject* self, PyObject* args)
 {
     auto pyInjector = reinterpret_cast<PyInjector*>(self);
-    auto& injector = pyInjector->injector;
-    PyObject* callback = injector->GetCallback();
-    Py_XINCREF(callback);
-    auto time = injector->GetDuration();
-    injector->Release();
-
-    // replace the injector
-    injector = std::make_shared<CLocalInjector>();
-    injector->SetCallback(callback);
-    injector->SetDuration(time);
-    injector->RecordStartTime();
-    CContextHelper::Instance().Start(injector);
-
-    Py_XDECREF(callback);
-    Py_RETURN_NONE;
+    CContextHelper::For(pyInjector->injector).Start(pyInjector->injector);
+    Py_INCREF(self);
+    return self;
+}
+
+static PyObject* InjectorExit(PyObject* self, PyObject* args)
+{
+    return InjectorStop(self, nullptr);
 }
 
 static PyMethodDef injector_methods[] = {
     { "start", (PyCFunction)InjectorStart, METH_NOARGS, nullptr },
     { "stop", (PyCFunction)InjectorStop, METH_NOARGS, nullptr },
     { "reset", (PyCFunction)InjectorReset, METH_NOARGS, nullptr },
+    { "__enter__", (PyCFunction)InjectorEnter, METH_NOARGS, nullptr },
+    { "__exit__", (PyCFunction)InjectorExit, METH_VARARGS, nullptr },
     {nullptr, nullptr}
 };
 
 PyDoc_STRVAR(injector_doc,
-"Injector(time: int, callback: callable)\n"
-"time unit: milliseconds");
-
-static PyTypeObject injector_type = {
-    PyVarObject_HEAD_INIT(0, 0)                 /* Must fill in type value later */
-    "Injector",                                 /* tp_name */
-    sizeof(PyInjector),                         /* tp_basicsize */
-    0,                                          /* tp_itemsize */
-    (destructor)DeallocPyInjector,              /* tp_dealloc */
-    0,                                          /* tp_print */
-    0,                                          /* tp_getattr */
-    0,                                          /* tp_setattr */
-    0,                                          /* tp_reserved */
-    0,                                          /* tp_repr */
-    0,                                          /* tp_as_number */
-    0,                                          /* tp_as_sequence */
-    0,                                          /* tp_as_mapping */
-    0,                                          /* tp_hash */
-    0,                                          /* tp_call */
-    0,                                          /* tp_str */
-    0,                                          /* tp_getattro */
-    0,                                          /* tp_setattro */
-    0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
-    injector_doc,                               /* tp_doc */
-    0,                                          /* tp_traverse */
-    0,                                          /* tp_clear */
-    0,                                          /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    0,                                          /* tp_iter */
-    0,                                          /* tp_iternext */
-    injector_methods,                           /* tp_methods */
-    0,                                          /* tp_members */
-    0,                                          /* tp_getset */
-    0,                                          /* tp_base */
-    0,                                          /* tp_dict */
-    0,                                          /* tp_descr_get */
-    0,                                          /* tp_descr_set */
-    0,                                          /* tp_dictoffset */
-    (initproc)InitPyInjector,                   /* tp_init */
-    0,                                          /* tp_alloc */
-    PyInjectorNew,                              /* tp_new */
-};
+"Injector(time: int | float, callback: callable, sink: callable = None)\n"
+"time unit: milliseconds, a float gives sub-millisecond timeouts\n"
+"An injector can be started again after stop, and used as a context manager\n"
+"With a sink the callback is not run on the starting thread, the sink is called\n"
+"from a helper thread with a list of (callback, start_time) per batch of timeouts\n"
+"With capture the stack of the thread is recorded at the timeout instead and\n"
+"the callback is only kept as a tag, see drain()\n"
+"With a site the time between start and stop is recorded for it, see snapshot()\n"
+"A watchdog's reset() only pushes the deadline of the running arming out, with\n"
+"a single store, until it expires\n"
+"With hard, exception (TimeoutError by default) is raised asynchronously in the\n"
+"starting thread once that many milliseconds passed, whatever the callback did.\n"
+"The callback may be None then\n"
+"With inherit it never runs past the guards around it on the thread, see remaining()");
 
-static PyMethodDef methods[] = {
+static PyType_Slot injector_slots[] = {
+    { Py_tp_dealloc, (void*)DeallocPyInjector },
+    { Py_tp_doc, (void*)injector_doc },
+    { Py_tp_methods, injector_methods },
+    { Py_tp_init, (void*)InitPyInjector },
+    { Py_tp_new, (void*)PyInjectorNew },
+    { 0, nullptr }
+};
 
-    { nullptr, nullptr}
+// a heap type, every interpreter has its own
+static PyType_Spec injector_spec = {
+    "_xtimeout.Injector",
+#ifdef Py_TPFLAGS_IMMUTABLETYPE
+    sizeof(PyInjector), 0, Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE, injector_slots
+#else
+    sizeof(PyInjector), 0, Py_TPFLAGS_DEFAULT, injector_slots
+#endif // Py_TPFLAGS_IMMUTABLETYPE
 };
 
-static struct PyModuleDef module = {
-    PyModuleDef_HEAD_INIT,
-    "_xtimeout",        /* m_name */
-    "_xtimeout",        /* m_doc */
-    -1,                 /* m_size */
-    methods,            /* m_methods */
-    NULL,               /* m_reload */
-    NULL,               /* m_traverse */
-    NULL,               /* m_clear */
-    NULL,               /* m_free */
+// per module object, i.e. per interpreter
+struct CModuleState
+{
+    PyObject* injectorType;
+    CRefPtr<CInterpreter> interp;
 };
 
+static CModuleState* GetModuleState(PyObject* m)
+{
+    return static_cast<CModuleState*>(PyModule_GetState(m));
+}
 
-PyMODINIT_FUNC PyInit__xtimeout()
+static PyObject* Drain(PyObject* self, PyObject* args)
+{
+    return GetModuleState(self)->interp->GetRing().Drain();
+}
+
+PyDoc_STRVAR(drain_doc,
+"drain() -> list\n"
+"Take the stacks recorded by capturing injectors, oldest first, as\n"
+"(tag, start_time, capture_time, [(code, lineno), ...]) with the innermost frame first.\n"
+"Only the latest 1024 are kept");
+
+static PyObject* Snapshot(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    static const char* kwlist[] = { "reset", nullptr };
+    int reset = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", const_cast<char**>(kwlist), &reset))
+    {
+        return nullptr;
+    }
+    return CSiteRegistry::Instance().Snapshot(reset != 0, GetModuleState(self)->interp.get());
+}
+
+PyDoc_STRVAR(snapshot_doc,
+"snapshot(reset: bool = False) -> dict\n"
+"Merge the elapsed time histograms of all threads of this interpreter as\n"
+"{site: [(lower_bound_ns, count), ...]}, each bucket is at most 12.5% wide.\n"
+"With reset the next snapshot only counts what is recorded after this one");
+
+static PyObject* Stats(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    static const char* kwlist[] = { "reset", nullptr };
+    int reset = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", const_cast<char**>(kwlist), &reset))
+    {
+        return nullptr;
+    }
+    return CStats::Instance().ToDict(reset != 0);
+}
+
+PyDoc_STRVAR(stats_doc,
+"stats(reset: bool = False) -> dict\n"
+"Counters of the checker thread and the deliveries since the last reset:\n"
+"merged armings, expired, cancelled and rescheduled deadlines, delivered timeouts and their\n"
+"lag behind the deadline, failed pending calls, waits of the delivery thread for\n"
+"the GIL, checker wakeups and the time it was busy. timers is the current size of\n"
+"the checker's heap and is not reset");
+
+static PyObject* Remaining(PyObject* self, PyObject* args)
+{
+    auto budget = CThreadDelivery::Current()->GetDeadlines().GetBudget(nullptr);
+    if (budget == std::chrono::time_point<ClockType>::max())
+    {
+        Py_RETURN_NONE;
+    }
+    return PyFloat_FromDouble(
+        std::chrono::duration<double, std::milli>(budget - ClockType::now()).count());
+}
+
+PyDoc_STRVAR(remaining_doc,
+"remaining() -> float | None\n"
+"Milliseconds left until the earliest deadline of the guards running on this\n"
+"thread, negative once it passed, None without any. Watchdogs, guards without\n"
+"a callback and the ones with a sink or capture aren't counted");
+
+static PyObject* Deadline(PyObject* self, PyObject* args)
+{
+    auto budget = CThreadDelivery::Current()->GetDeadlines().GetBudget(nullptr);
+    if (budget == std::chrono::time_point<ClockType>::max())
+    {
+        Py_RETURN_NONE;
+    }
+    return TimePointToPyFloat(budget);
+}
+
+PyDoc_STRVAR(deadline_doc,
+"deadline() -> float | None\n"
+"The deadline remaining() counts down to, on the clock of start_time, e.g. to be\n"
+"handed to another thread");
+
+static PyObject* Now(PyObject* self, PyObject* args)
+{
+    return TimePointToPyFloat(ClockType::now());
+}
+
+PyDoc_STRVAR(now_doc,
+"now() -> float\n"
+"Seconds on the clock of start_time and deadline()");
+
+static PyObject* SetCheckers(PyObject* self, PyObject* arg)
+{
+    long count = PyLong_AsLong(arg);
+    if (count == -1 && PyErr_Occurred())
+    {
+        return nullptr;
+    }
+    if (count < 1 || count > static_cast<long>(MAX_CHECKERS))
+    {
+        PyErr_Format(PyExc_ValueError, "count must be between 1 and %u", MAX_CHECKERS);
+        return nullptr;
+    }
+    return PyLong_FromUnsignedLong(
+        g_CheckerCount.exchange(static_cast<uint32_t>(count), std::memory_order_relaxed));
+}
+
+PyDoc_STRVAR(set_checkers_doc,
+"set_checkers(count: int) -> int\n"
+"Spread the threads that use injectors from now on over count checker threads,\n"
+"each with its own timers and wakeup. A thread keeps the checker it got first.\n"
+"Returns the previous count, 1 by default");
+
+static const char* const CLOCK_NAMES[] = { "steady", "coarse", "tsc" };
+
+static PyObject* SetClock(PyObject* self, PyObject* arg)
 {
-    if (PyType_Ready(&injector_type) != 0)
+    const char* name = PyUnicode_AsUTF8(arg);
+    if (name == nullptr)
     {
         return nullptr;
     }
-    PyObject* m = PyModule_Create(&module);
-    if (m == nullptr)
+    auto& clock = CArmClock::Instance();
+    auto previous = clock.GetKind();
+    for (size_t i = 0; i < sizeof(CLOCK_NAMES) / sizeof(CLOCK_NAMES[0]); i++)
+    {
+        if (strcmp(name, CLOCK_NAMES[i]) != 0)
+        {
+            continue;
+        }
+        if (!clock.SetKind(static_cast<CArmClock::Kind>(i)))
+        {
+            PyErr_Format(PyExc_ValueError, "clock %s isn't available", name);
+            return nullptr;
+        }
+        return PyUnicode_FromString(CLOCK_NAMES[previous]);
+    }
+    PyErr_Format(PyExc_ValueError, "unknown clock %s", name);
+    return nullptr;
+}
+
+PyDoc_STRVAR(set_clock_doc,
+"set_clock(name: str) -> str\n"
+"Clock read when an injector starts, all of them share the epoch of now() and\n"
+"the checker keeps the steady one. \"steady\" by default, \"coarse\" reads CLOCK_MONOTONIC_COARSE\n"
+"on Linux and may fire up to its resolution late, \"tsc\" scales the invariant\n"
+"TSC of x86 after calibrating it for 10 ms. ValueError if it isn't available.\n"
+"Returns the previous name");
+
+// C API for other extension modules, see xtimeout_capi.h
+struct XTimeoutTimer
+{
+    CInjectorPtr injector;
+};
+
+static XTimeoutTimer* CApiCreate(PyObject* callback)
+{
+    if (!PyCallable_Check(callback))
     {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable");
         return nullptr;
     }
-    if (PyModule_AddObject(m, "Injector", (PyObject*)&injector_type) != 0)
+    auto timer = new XTimeoutTimer{ CInjectorPtr(new CLocalInjector()) };
+    timer->injector->SetCallback(callback);
+    return timer;
+}
+
+static XTimeoutTimer* CApiCreateNative(XTimeoutNativeCallback callback, void* arg)
+{
+    if (callback == nullptr)
     {
+        PyErr_SetString(PyExc_ValueError, "callback must not be NULL");
         return nullptr;
     }
+    auto timer = new XTimeoutTimer{ CInjectorPtr(new CLocalInjector()) };
+    timer->injector->SetNativeCallback(callback, arg);
+    return timer;
+}
+
+static void CApiStart(XTimeoutTimer* timer, int64_t timeout_ns)
+{
+    static const int64_t MAX_TIMEOUT_NS = static_cast<int64_t>(MAX_TIMEOUT_MS * 1e6);
+    auto& injector = timer->injector;
+    injector->SetDuration(std::chrono::nanoseconds(
+        std::max<int64_t>(0, std::min(timeout_ns, MAX_TIMEOUT_NS))));
+    CContextHelper::For(injector).Start(injector);
+}
+
+static void CApiStop(XTimeoutTimer* timer)
+{
+    CContextHelper::For(timer->injector).Stop(timer->injector);
+}
+
+static void CApiDestroy(XTimeoutTimer* timer)
+{
+    CApiStop(timer);
+    timer->injector->Release();
+    delete timer;
+}
+
+static int64_t CApiRemaining()
+{
+    auto budget = CThreadDelivery::Current()->GetDeadlines().GetBudget(nullptr);
+    if (budget == std::chrono::time_point<ClockType>::max())
+    {
+        return INT64_MAX;
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(budget - ClockType::now()).count();
+}
+
+static XTimeout_CAPI capi = {
+    XTIMEOUT_CAPI_VERSION,
+    CApiCreate,
+    CApiCreateNative,
+    CApiStart,
+    CApiStop,
+    CApiDestroy,
+    CApiRemaining,
+};
+
+static PyMethodDef methods[] = {
+    { "drain", (PyCFunction)Drain, METH_NOARGS, drain_doc },
+    { "snapshot", (PyCFunction)(void(*)(void))Snapshot, METH_VARARGS | METH_KEYWORDS, snapshot_doc },
+    { "stats", (PyCFunction)(void(*)(void))Stats, METH_VARARGS | METH_KEYWORDS, stats_doc },
+    { "set_checkers", (PyCFunction)SetCheckers, METH_O, set_checkers_doc },
+    { "set_clock", (PyCFunction)SetClock, METH_O, set_clock_doc },
+    { "remaining", (PyCFunction)Remaining, METH_NOARGS, remaining_doc },
+    { "deadline", (PyCFunction)Deadline, METH_NOARGS, deadline_doc },
+    { "now", (PyCFunction)Now, METH_NOARGS, now_doc },
+    { nullptr, nullptr}
+};
+
+static PyObject* CloseInterpreter(PyObject* self, PyObject* args)
+{
+    GetModuleState(self)->interp->Close();
+    Py_RETURN_NONE;
+}
+
+// stop delivering into a subinterpreter before it starts finalizing, a
+// thread taking its GIL after that never returns
+static int CloseAtExit(PyObject* m)
+{
+    static PyMethodDef def = { "_close", (PyCFunction)CloseInterpreter, METH_NOARGS, nullptr };
+    CPyObjectHolder atexit = PyImport_ImportModule("atexit");
+    CPyObjectHolder func = PyCFunction_New(&def, m);
+    if (!atexit || !func)
+    {
+        return -1;
+    }
+    CPyObjectHolder res = PyObject_CallMethod(atexit, "register", "O", func.Get());
+    return res ? 0 : -1;
+}
+
+static int ExecModule(PyObject* m)
+{
+    auto state = GetModuleState(m);
+    new (&state->interp) CRefPtr<CInterpreter>(CInterpreter::Get(GetInterpreter(PyThreadState_GET())));
+    state->interp->AddModule();
+    if (!state->interp->IsMain() && CloseAtExit(m) != 0)
+    {
+        return -1;
+    }
+    state->injectorType = PyType_FromSpec(&injector_spec);
+    if (state->injectorType == nullptr)
+    {
+        return -1;
+    }
+    Py_INCREF(state->injectorType);
+    if (PyModule_AddObject(m, "Injector", state->injectorType) != 0)
+    {
+        Py_DECREF(state->injectorType);
+        return -1;
+    }
+    PyObject* capsule = PyCapsule_New(&capi, XTIMEOUT_CAPI_NAME, nullptr);
+    if (capsule == nullptr)
+    {
+        return -1;
+    }
+    if (PyModule_AddObject(m, "_C_API", capsule) != 0)
+    {
+        Py_DECREF(capsule);
+        return -1;
+    }
 #ifdef WITH_THREAD
+#if (PY_VERSION_HEX < 0x03070000)
     PyEval_InitThreads();
-    g_PyTLSKey = GetPyThreadIndex();
-    PyInterpreterState* interpreter = PyInterpreterState_Head();
-    g_MainThreadId = interpreter->tstate_head->thread_id;
 #endif
-    return m;
+    // new thread states are linked at the head, the main thread's is the last one
+    PyThreadState* main = PyInterpreterState_ThreadHead(GetMainInterpreter());
+    while (PyThreadState_Next(main) != nullptr)
+    {
+        main = PyThreadState_Next(main);
+    }
+    g_MainThreadId = main->thread_id;
+#endif
+#ifdef USE_ATFORK
+    // once per process, the module is never unloaded
+    static const int atFork = pthread_atfork(BeforeFork, AfterForkInParent, AfterForkInChild);
+    if (atFork != 0)
+    {
+        errno = atFork;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+#endif // USE_ATFORK
+    return 0;
+}
+
+static int TraverseModule(PyObject* m, visitproc visit, void* arg)
+{
+    auto state = GetModuleState(m);
+    Py_VISIT(state->injectorType);
+    return 0;
+}
+
+static int ClearModule(PyObject* m)
+{
+    auto state = GetModuleState(m);
+    Py_CLEAR(state->injectorType);
+    return 0;
+}
+
+static void FreeModule(void* m)
+{
+    auto state = GetModuleState(static_cast<PyObject*>(m));
+    ClearModule(static_cast<PyObject*>(m));
+    // null if the module failed to load
+    if (state->interp)
+    {
+        state->interp->ReleaseModule();
+        state->interp = nullptr;
+    }
+}
+
+static PyModuleDef_Slot module_slots[] = {
+    { Py_mod_exec, (void*)ExecModule },
+#if (PY_VERSION_HEX >= 0x030C0000)
+    // the timer state of an interpreter is only touched under its own GIL
+    { Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+#endif
+#if (PY_VERSION_HEX >= 0x030D0000)
+    // the injector objects themselves still rely on the GIL, a free-threaded
+    // build turns it on at import until they don't
+    { Py_mod_gil, Py_MOD_GIL_USED },
+#endif
+    { 0, nullptr }
+};
+
+static struct PyModuleDef module = {
+    PyModuleDef_HEAD_INIT,
+    "_xtimeout",            /* m_name */
+    "_xtimeout",            /* m_doc */
+    sizeof(CModuleState),   /* m_size */
+    methods,                /* m_methods */
+    module_slots,           /* m_slots */
+    TraverseModule,         /* m_traverse */
+    ClearModule,            /* m_clear */
+    FreeModule,             /* m_free */
+};
+
+
+PyMODINIT_FUNC PyInit__xtimeout()
+{
+    return PyModuleDef_Init(&module);
 }
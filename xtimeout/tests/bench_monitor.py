@@ -0,0 +1,159 @@
+"""Microbenchmarks for the guard overhead and the timeout delivery latency.
+
+    python -m xtimeout.tests.bench_monitor [--quick]
+    python setup.py bench [--quick]     # builds the extension in place first
+
+Overhead is reported in ns per operation, latency as the gap between the
+deadline and the time the callback starts running, in microseconds.
+"""
+import argparse
+import sys
+import threading
+import time
+
+import xtimeout
+from xtimeout import Injector
+
+
+def noop(start_time):
+    pass
+
+
+def percentile(values, pct):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * pct / 100.0))]
+
+
+def report(name, values, unit):
+    if not values:
+        print("%-36s no samples" % name)
+        return
+    print("%-36s n=%-6d p50=%-9.1f p90=%-9.1f p99=%-9.1f max=%.1f %s" % (
+        name, len(values), percentile(values, 50), percentile(values, 90),
+        percentile(values, 99), max(values), unit))
+
+
+def run_threads(count, target):
+    barrier = threading.Barrier(count + 1)
+
+    def run():
+        barrier.wait()
+        target()
+
+    threads = [threading.Thread(target=run) for _ in range(count)]
+    for t in threads:
+        t.start()
+    barrier.wait()
+    start = time.perf_counter()
+    for t in threads:
+        t.join()
+    return time.perf_counter() - start
+
+
+def bench_context(loops):
+    def run():
+        context = xtimeout.check_context(60000, noop)
+        for _ in range(loops):
+            with context:
+                pass
+    return run
+
+
+def bench_start_stop(loops):
+    def run():
+        injector = Injector(60000, noop)
+        start, stop = injector.start, injector.stop
+        for _ in range(loops):
+            start()
+            stop()
+    return run
+
+
+def bench_empty(loops):
+    def run():
+        for _ in range(loops):
+            pass
+    return run
+
+
+def overhead(threads, loops):
+    print("[overhead] ns per op, per thread, wall time x threads / ops")
+    for count in threads:
+        base = run_threads(count, bench_empty(loops))
+        for name, bench in (("check_context enter/exit", bench_context),
+                            ("Injector start/stop", bench_start_stop)):
+            elapsed = run_threads(count, bench(loops)) - base
+            print("%-36s threads=%-3d %8.1f ns" % (
+                name, count, elapsed * count / loops * 1e9))
+
+
+def armed(sizes, loops):
+    print("[armed] ns per check_context enter/exit with idle armed injectors")
+    for size in sizes:
+        injectors = [Injector(600000, noop) for _ in range(size)]
+        for injector in injectors:
+            injector.start()
+        try:
+            elapsed = run_threads(1, bench_context(loops))
+        finally:
+            for injector in injectors:
+                injector.stop()
+        print("%-36s armed=%-6d %8.1f ns" % (
+            "check_context enter/exit", size, elapsed / loops * 1e9))
+
+
+def collect_lag(samples, timeout):
+    lags = []
+
+    def on_timeout(start_time):
+        lags.append((time.monotonic() - deadline) * 1e6)
+
+    for _ in range(samples):
+        count = len(lags)
+        deadline = time.monotonic() + timeout / 1000.0
+        with xtimeout.check_context(timeout, on_timeout):
+            # a child thread can only be reached once it drops the GIL
+            end = deadline + 1.0
+            while len(lags) == count and time.monotonic() < end:
+                pass
+    return lags
+
+
+def latency(samples, timeout):
+    print("[latency] callback start - deadline, timeout=%g ms" % timeout)
+    report("main thread (pending call)", collect_lag(samples, timeout), "us")
+
+    result = []
+
+    def run():
+        result.extend(collect_lag(samples, timeout))
+
+    run_threads(1, run)
+    report("child thread (trace / monitoring)", result, "us")
+
+    result = []
+    run_threads(4, run)
+    report("4 child threads (trace / monitoring)", result, "us")
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--quick", action="store_true", help="fewer loops and samples")
+    args = parser.parse_args(argv)
+
+    if args.quick:
+        loops, samples = 20000, 20
+        threads, sizes = (1, 4), (10, 1000)
+    else:
+        loops, samples = 200000, 200
+        threads, sizes = (1, 2, 4, 8, 16, 32, 64), (10, 100, 1000, 10000, 100000)
+
+    print("python %s" % sys.version.split()[0])
+    overhead(threads, loops)
+    armed(sizes, loops)
+    latency(samples, 2)
+    latency(samples, 0.2)
+
+
+if __name__ == "__main__":
+    main()
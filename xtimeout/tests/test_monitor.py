@@ -1,8 +1,14 @@
+import asyncio
+import builtins
 import functools
+import gc
+import importlib
+import os
 import random
 import sys
 import time
 import unittest
+import warnings
 
 import xtimeout
 
@@ -69,10 +75,10 @@ class TestMonitor(unittest.TestCase):
 
         start = time.time()
         with xtimeout.check_context(50, on_timeout_1):
-            start1 = time.clock()
-            while time.clock() - start1 < 0.1:
+            start1 = time.perf_counter()
+            while time.perf_counter() - start1 < 0.1:
                 for i in range(2):
-                    start2 = time.clock()
+                    start2 = time.perf_counter()
                     with xtimeout.check_context(10, on_timeout_2):
                         busy(0.1)
 
@@ -80,6 +86,35 @@ class TestMonitor(unittest.TestCase):
         self.assertTrue(called1)
         self.assertTrue(called2)
 
+    def test_earlier_deadline(self):
+        def on_timeout(start_time):
+            raise TimeoutError
+
+        start = time.time()
+        with self.assertRaises(TimeoutError):
+            with xtimeout.check_context(5000, on_timeout):
+                with xtimeout.check_context(50, on_timeout):
+                    busy(-1)
+        elapsed = time.time() - start
+        self.assertAlmostEqual(elapsed, 0.05, delta=0.03)
+
+    def test_expire_burst(self):
+        def on_timeout(start_time):
+            nonlocal count
+            count += 1
+
+        def nest(depth):
+            if depth == 0:
+                busy(0.1)
+                return
+            with xtimeout.check_context(20, on_timeout):
+                nest(depth - 1)
+
+        count = 0
+        # more than the interpreter's pending call ring can hold
+        nest(100)
+        self.assertEqual(count, 100)
+
     def test_break(self):
         def on_timeout(start_time):
             raise TimeoutError
@@ -100,6 +135,24 @@ class TestMonitor(unittest.TestCase):
             func()
         self.assertEqual(context.exception.args[0], "Timeout")
 
+    def test_decorator_reuse(self):
+        def on_timeout(start_time):
+            nonlocal count
+            count += 1
+
+        @xtimeout.check_time(20, on_timeout)
+        def func(seconds, depth=0):
+            if depth:
+                func(seconds, depth - 1)
+            busy(seconds)
+
+        count = 0
+        for i in range(100):
+            func(0)
+        self.assertEqual(count, 0)
+        func(0.05, depth=1)
+        self.assertEqual(count, 2)
+
     def test_trace_recover(self):
         def dummy_trace(*args):
             pass
@@ -117,6 +170,22 @@ class TestMonitor(unittest.TestCase):
         finally:
             sys.settrace(old_trace)
 
+    def test_restart(self):
+        def on_timeout(start_time):
+            nonlocal count
+            count += 1
+
+        count = 0
+        injector = xtimeout.Injector(50, on_timeout)
+        injector.start()
+        injector.stop()
+        busy(0.1)
+        self.assertEqual(count, 0)
+        injector.start()
+        busy(0.1)
+        injector.stop()
+        self.assertEqual(count, 1)
+
     def test_reset(self):
         def ont_time(start_time):
             raise TimeoutError
@@ -167,6 +236,757 @@ class TestMultiThread(unittest.TestCase):
             th.join()
         self.assertEqual(count, 4)
 
+    def test_sharded_checkers(self):
+        def on_timeout(start_time):
+            nonlocal count
+            count += 1
+            raise TimeoutError
+        count = 0
+        def thfunc():
+            for i in range(3):
+                with self.assertRaises(TimeoutError):
+                    with xtimeout.check_context(20, on_timeout):
+                        busy(-1)
+
+        with self.assertRaises(ValueError):
+            xtimeout.set_checkers(0)
+        previous = xtimeout.set_checkers(4)
+        try:
+            ths = [threading.Thread(target=thfunc) for i in range(8)]
+            for th in ths:
+                th.start()
+            for th in ths:
+                th.join()
+        finally:
+            self.assertEqual(xtimeout.set_checkers(previous), 4)
+        self.assertEqual(count, 24)
+
+    def test_clock(self):
+        def on_timeout(start_time):
+            elapsed.append(xtimeout.now() - start_time)
+            raise TimeoutError
+
+        def thfunc():
+            with self.assertRaises(TimeoutError):
+                with xtimeout.check_context(20, on_timeout):
+                    busy(-1)
+
+        with self.assertRaises(ValueError):
+            xtimeout.set_clock("wall")
+        for name in ("coarse", "tsc"):
+            try:
+                previous = xtimeout.set_clock(name)
+            except ValueError:
+                continue
+            elapsed = []
+            try:
+                thfunc()
+                th = threading.Thread(target=thfunc)
+                th.start()
+                th.join()
+            finally:
+                self.assertEqual(xtimeout.set_clock(previous), name)
+            self.assertEqual(len(elapsed), 2)
+            for value in elapsed:
+                # start_time stays on the epoch of now()
+                self.assertTrue(0.019 <= value < 0.2, (name, value))
+
+    def test_callback_start_time(self):
+        def on_timeout(start_time):
+            starts.append(start_time)
+
+        def thfunc():
+            armed.append(time.monotonic())
+            with xtimeout.check_context(10, on_timeout):
+                busy(0.05)
+
+        starts, armed = [], []
+        thfunc()
+        th = threading.Thread(target=thfunc)
+        th.start()
+        th.join()
+        self.assertEqual(len(starts), 2)
+        for start, expected in zip(starts, armed):
+            self.assertIsInstance(start, float)
+            if sys.platform.startswith("linux"):
+                # the steady clock is CLOCK_MONOTONIC there
+                self.assertAlmostEqual(start, expected, delta=0.01)
+
+    def test_child_thread_hard_deadline(self):
+        class HardTimeout(Exception):
+            pass
+
+        def thfunc():
+            with self.assertRaises(HardTimeout):
+                with xtimeout.check_context(10, None, hard=30, exception=HardTimeout):
+                    busy(-1)
+            result.append(True)
+
+        result = []
+        th = threading.Thread(target=thfunc)
+        th.start()
+        th.join()
+        self.assertEqual(result, [True])
+
+    def test_batched_delivery(self):
+        fired = []
+
+        def make_callback(timeout):
+            def on_timeout(start_time):
+                fired.append(timeout)
+            return on_timeout
+
+        def thfunc():
+            timeouts = [50, 40, 30, 20, 10]
+            injectors = [xtimeout.Injector(t, make_callback(t)) for t in timeouts]
+            for injector in injectors:
+                injector.start()
+            # all of them expire while the thread can't run Python code
+            time.sleep(0.1)
+            busy(0.05)
+            for injector in injectors:
+                injector.stop()
+
+        th = threading.Thread(target=thfunc)
+        th.start()
+        th.join()
+        self.assertEqual(fired, [10, 20, 30, 40, 50])
+
+    def test_many_timers(self):
+        fired = {}
+
+        def sink(batch):
+            now = xtimeout.now()
+            for callback, start_time in batch:
+                fired[callback] = now - start_time
+
+        timeouts = {}
+        injectors = []
+        for i in range(500):
+            timeout = random.uniform(5, 100)
+            callback = functools.partial(lambda i: i, i)
+            injector = xtimeout.Injector(timeout, callback, sink=sink)
+            injector.start()
+            injectors.append(injector)
+            # stopped ones leave stale timers behind and get compacted away
+            if i % 3 == 0:
+                injector.stop()
+            else:
+                timeouts[callback] = timeout
+        time.sleep(0.3)
+        self.assertEqual(set(fired), set(timeouts))
+        for callback, elapsed in fired.items():
+            self.assertGreaterEqual(elapsed * 1000, timeouts[callback] - 1)
+            self.assertLess(elapsed * 1000, timeouts[callback] + 100)
+
+    def test_child_thread_trace_recover(self):
+        def dummy_trace(*args):
+            pass
+
+        def on_timeout(start_time):
+            self.assertEqual(sys.gettrace(), dummy_trace)
+            raise TimeoutError
+
+        def thfunc():
+            sys.settrace(dummy_trace)
+            try:
+                with self.assertRaises(TimeoutError):
+                    with xtimeout.check_context(50, on_timeout):
+                        busy(-1)
+            finally:
+                sys.settrace(None)
+
+        th = threading.Thread(target=thfunc)
+        th.start()
+        th.join()
+
+    @unittest.skipIf(sys.version_info < (3, 12), "no sys.monitoring")
+    def test_monitoring_one_shot(self):
+        def on_timeout(start_time):
+            raise TimeoutError
+
+        def thfunc():
+            with self.assertRaises(TimeoutError):
+                with xtimeout.check_context(50, on_timeout):
+                    busy(-1)
+
+        th = threading.Thread(target=thfunc)
+        th.start()
+        th.join()
+        tool_id = next(i for i in range(6)
+                       if sys.monitoring.get_tool(i) == "xtimeout")
+        self.assertEqual(sys.monitoring.get_events(tool_id), 0)
+
+    def test_concurrent_start_stop(self):
+        def on_timeout(start_time):
+            raise TimeoutError
+
+        def thfunc():
+            for i in range(2000):
+                with xtimeout.check_context(1000, on_timeout):
+                    pass
+
+        ths = [threading.Thread(target=thfunc) for i in range(8)]
+        for th in ths:
+            th.start()
+        with self.assertRaises(TimeoutError):
+            with xtimeout.check_context(50, on_timeout):
+                busy(-1)
+        for th in ths:
+            th.join()
+
+    def test_free_on_other_thread(self):
+        fired = []
+        injectors = []
+
+        def thfunc():
+            injectors.extend(xtimeout.Injector(1000, fired.append) for i in range(100))
+            injectors[-1].start()
+
+        # the pools of the threads outlive them until the injectors go
+        for i in range(4):
+            th = threading.Thread(target=thfunc)
+            th.start()
+            th.join()
+        for injector in injectors:
+            injector.stop()
+        del injectors[:]
+        gc.collect()
+        with xtimeout.check_context(10, fired.append):
+            busy(0.05)
+        self.assertEqual(len(fired), 1)
+
+    def test_covered_deadlines(self):
+        def on_timeout(start_time):
+            fired.append(time.time() - start)
+
+        # the inner deadlines end after the outer one and are published later
+        fired = []
+        start = time.time()
+        with xtimeout.check_context(30, on_timeout):
+            with xtimeout.check_context(100, on_timeout):
+                with xtimeout.check_context(150, on_timeout):
+                    busy(0.25)
+        self.assertEqual(len(fired), 3)
+        self.assertGreaterEqual(fired[2], 0.15)
+
+        # stopping the covering one first
+        fired = []
+        start = time.time()
+        outer = xtimeout.Injector(30, on_timeout)
+        inner = xtimeout.Injector(80, on_timeout)
+        outer.start()
+        inner.start()
+        outer.stop()
+        busy(0.15)
+        inner.stop()
+        self.assertEqual(len(fired), 1)
+        self.assertGreaterEqual(fired[0], 0.08)
+
+    def test_sub_millisecond(self):
+        def on_timeout(start_time):
+            fired.append(time.perf_counter() - start)
+
+        fired = []
+        # a main thread timeout mustn't wait for the next switch of the GIL
+        interval = sys.getswitchinterval()
+        sys.setswitchinterval(0.1)
+        try:
+            start = time.perf_counter()
+            with xtimeout.check_context(0.5, on_timeout):
+                busy(0.2)
+        finally:
+            sys.setswitchinterval(interval)
+        self.assertEqual(len(fired), 1)
+        self.assertGreaterEqual(fired[0], 0.0005)
+        self.assertLess(fired[0], 0.02)
+
+        for bad in (-1, -0.5, float("nan"), 1e20):
+            with self.assertRaises(ValueError):
+                xtimeout.Injector(bad, on_timeout)
+        with self.assertRaises(TypeError):
+            xtimeout.Injector("10", on_timeout)
+
+    def test_capture(self):
+        def spin():
+            busy(0.1)
+
+        @xtimeout.capture_time(20)
+        def slow():
+            spin()
+
+        xtimeout.drain()
+        slow()
+        with xtimeout.capture_context(20, "ctx"):
+            pass
+        if thread_enabled:
+            th = threading.Thread(target=slow)
+            th.start()
+            th.join()
+        records = xtimeout.drain()
+        self.assertEqual(len(records), 2 if thread_enabled else 1)
+        for tag, start_time, capture_time, frames in records:
+            self.assertIs(tag, slow.__wrapped__.__code__)
+            self.assertGreaterEqual(capture_time - start_time, 0.02)
+            names = [code.co_name for code, lineno in frames]
+            self.assertIn("spin", names)
+            self.assertLess(names.index("spin"), names.index("slow"))
+        self.assertEqual(xtimeout.drain(), [])
+
+    def test_capture_without_tag(self):
+        xtimeout.drain()
+        with xtimeout.capture_context(20):
+            busy(0.1)
+        records = xtimeout.drain()
+        self.assertEqual(len(records), 1)
+        tag, start_time, capture_time, frames = records[0]
+        self.assertIsNone(tag)
+        self.assertGreaterEqual(capture_time - start_time, 0.02)
+
+    def test_histogram(self):
+        def noop(start_time):
+            pass
+
+        @xtimeout.check_time(1000, noop, histogram=True)
+        def fast():
+            pass
+
+        @xtimeout.check_time(1000, noop, histogram=True)
+        def slow():
+            busy(0.01)
+
+        def thfunc():
+            for i in range(100):
+                fast()
+
+        xtimeout.snapshot(reset=True)
+        for i in range(1000):
+            fast()
+        for i in range(5):
+            slow()
+        if thread_enabled:
+            th = threading.Thread(target=thfunc)
+            th.start()
+            th.join()
+        snap = xtimeout.snapshot(reset=True)
+        fast_buckets = snap[fast.__wrapped__.__code__]
+        slow_buckets = snap[slow.__wrapped__.__code__]
+        self.assertEqual(sum(c for b, c in fast_buckets), 1100 if thread_enabled else 1000)
+        self.assertEqual(sum(c for b, c in slow_buckets), 5)
+        self.assertGreaterEqual(xtimeout.quantile(slow_buckets, 0.5), 0.01 * 1e9 * 0.875)
+        self.assertLess(xtimeout.quantile(fast_buckets, 0.5), 0.001 * 1e9)
+        self.assertEqual(xtimeout.snapshot(), {})
+
+        merged = xtimeout.merge(snap, snap)
+        self.assertEqual(sum(c for b, c in merged[slow.__wrapped__.__code__]), 10)
+
+    def test_watchdog(self):
+        def on_timeout(start_time):
+            nonlocal count
+            count += 1
+
+        count = 0
+        xtimeout.stats(reset=True)
+        with xtimeout.check_context(50, on_timeout, watchdog=True) as context:
+            for i in range(20):
+                busy(0.01)
+                context.reset()
+            self.assertEqual(count, 0)
+            busy(0.1)
+            self.assertEqual(count, 1)
+            # expired, the next reset arms it again
+            context.reset()
+            busy(0.1)
+            self.assertEqual(count, 2)
+        self.assertGreater(xtimeout.stats()["rescheduled"], 0)
+
+    def test_hard_deadline(self):
+        class HardTimeout(Exception):
+            pass
+
+        def on_timeout(start_time):
+            nonlocal count
+            count += 1
+
+        count = 0
+        start = time.time()
+        with self.assertRaises(HardTimeout):
+            with xtimeout.check_context(10, on_timeout, hard=50, exception=HardTimeout):
+                busy(-1)
+        self.assertEqual(count, 1)
+        self.assertGreaterEqual(time.time() - start, 0.05)
+
+        # without any callback
+        with self.assertRaises(HardTimeout):
+            with xtimeout.check_context(10, None, hard=20, exception=HardTimeout):
+                busy(-1)
+
+        # stopped in time
+        with xtimeout.check_context(10, on_timeout, hard=20, exception=HardTimeout):
+            pass
+        busy(0.05)
+
+        with self.assertRaises(ValueError):
+            xtimeout.Injector(20, on_timeout, hard=10)
+        with self.assertRaises(TypeError):
+            xtimeout.Injector(20, None)
+
+    def test_remaining(self):
+        def on_timeout(start_time):
+            nonlocal fired
+            fired = True
+
+        self.assertIsNone(xtimeout.remaining())
+        self.assertIsNone(xtimeout.deadline())
+        with xtimeout.check_context(100, on_timeout):
+            self.assertTrue(0 < xtimeout.remaining() <= 100)
+            with xtimeout.check_context(1000, on_timeout):
+                self.assertTrue(0 < xtimeout.remaining() <= 100)
+                with xtimeout.check_context(50, on_timeout):
+                    self.assertTrue(0 < xtimeout.remaining() <= 50)
+                self.assertGreater(xtimeout.remaining(), 50)
+            end = xtimeout.deadline()
+            self.assertAlmostEqual(end - xtimeout.now(), xtimeout.remaining() / 1000, delta=0.005)
+        self.assertIsNone(xtimeout.remaining())
+
+        # an inheriting guard ends with its parent
+        fired = False
+        with xtimeout.check_context(1000, lambda start_time: None):
+            with xtimeout.check_context(50, on_timeout):
+                with xtimeout.check_context(1000, on_timeout, inherit=True):
+                    self.assertTrue(0 < xtimeout.remaining() <= 50)
+                    start = time.time()
+                    while not fired and time.time() - start < 1:
+                        pass
+                    self.assertLess(xtimeout.remaining(), 0)
+        self.assertTrue(fired)
+
+    @unittest.skipIf(not thread_enabled, "no threading")
+    def test_propagate(self):
+        def on_timeout(start_time):
+            pass
+
+        def work():
+            budgets.append(xtimeout.remaining())
+
+        budgets = []
+        self.assertIs(xtimeout.propagate(work, on_timeout), work)
+        with xtimeout.check_context(200, on_timeout):
+            task = xtimeout.propagate(work, on_timeout)
+            time.sleep(0.05)
+            th = threading.Thread(target=task)
+            th.start()
+            th.join()
+        self.assertEqual(len(budgets), 1)
+        self.assertTrue(0 < budgets[0] <= 150)
+
+    def test_c_api(self):
+        import ctypes
+        import _xtimeout
+
+        native_callback = ctypes.CFUNCTYPE(None, ctypes.c_void_p)
+
+        class CAPI(ctypes.Structure):
+            _fields_ = [
+                ("version", ctypes.c_int),
+                ("create", ctypes.PYFUNCTYPE(ctypes.c_void_p, ctypes.py_object)),
+                ("create_native", ctypes.PYFUNCTYPE(ctypes.c_void_p, native_callback, ctypes.c_void_p)),
+                ("start", ctypes.PYFUNCTYPE(None, ctypes.c_void_p, ctypes.c_int64)),
+                ("stop", ctypes.PYFUNCTYPE(None, ctypes.c_void_p)),
+                ("destroy", ctypes.PYFUNCTYPE(None, ctypes.c_void_p)),
+                ("remaining", ctypes.PYFUNCTYPE(ctypes.c_int64)),
+            ]
+
+        get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+        get_pointer.restype = ctypes.c_void_p
+        get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+        api = CAPI.from_address(get_pointer(_xtimeout._C_API, b"_xtimeout._C_API"))
+        self.assertEqual(api.version, 1)
+
+        def on_timeout(start_time):
+            raise TimeoutError
+
+        timer = api.create(on_timeout)
+        self.assertGreater(api.remaining(), 2 ** 62)
+        with self.assertRaises(TimeoutError):
+            api.start(timer, 20 * 1000000)
+            self.assertTrue(0 < api.remaining() <= 20 * 1000000)
+            busy(-1)
+        api.stop(timer)
+        api.destroy(timer)
+
+        # a native callback runs on the checker thread
+        if thread_enabled:
+            fired = threading.Event()
+            callback = native_callback(lambda arg: fired.set())
+            timer = api.create_native(callback, None)
+            api.start(timer, 10 * 1000000)
+            self.assertTrue(fired.wait(1))
+            api.destroy(timer)
+
+        with self.assertRaises(TypeError):
+            api.create(None)
+
+    def test_subinterpreter(self):
+        try:
+            import _interpreters as interpreters
+            interp = interpreters.create()
+        except ImportError:
+            try:
+                import _xxsubinterpreters as interpreters
+            except ImportError:
+                self.skipTest("no subinterpreters")
+            # 3.9 only makes isolated ones, which can't start threads. 3.10 and
+            # later can make a legacy one, and 3.12 can't destroy an isolated
+            # one that imported asyncio
+            if sys.version_info[:2] == (3, 9):
+                self.skipTest("3.9 subinterpreters can't start threads")
+            legacy = {"isolated": False} if sys.version_info >= (3, 10) else {}
+            interp = interpreters.create(**legacy)
+        script = """if 1:
+            import sys
+            sys.path[:] = %r
+            import threading
+            import time
+            import xtimeout
+
+            def guarded(site=None):
+                fired = []
+                with xtimeout.check_context(10, fired.append, site=site):
+                    end = time.time() + 2
+                    while not fired and time.time() < end:
+                        pass
+                results.append(len(fired))
+
+            results = []
+            guarded("sub")
+            th = threading.Thread(target=guarded)
+            th.start()
+            th.join()
+            assert results == [1, 1], results
+            assert list(xtimeout.snapshot()) == ["sub"]
+        """ % (sys.path,)
+        try:
+            res = interpreters.run_string(interp, script)
+            self.assertIsNone(res)
+        finally:
+            interpreters.destroy(interp)
+        self.assertNotIn("sub", xtimeout.snapshot())
+
+        fired = []
+        with xtimeout.check_context(10, fired.append):
+            busy(0.05)
+        self.assertEqual(len(fired), 1)
+
+    def test_reimport(self):
+        def on_timeout(start_time):
+            raise TimeoutError
+
+        def thfunc():
+            # made before the reloaded module goes away
+            injector = xtimeout.Injector(20, on_timeout)
+            reloaded.wait()
+            try:
+                with injector:
+                    busy(1)
+            except TimeoutError:
+                fired.append(True)
+
+        fired = []
+        reloaded = threading.Event()
+        th = threading.Thread(target=thfunc)
+        th.start()
+        module = sys.modules.pop("_xtimeout")
+        try:
+            other = importlib.import_module("_xtimeout")
+        finally:
+            sys.modules["_xtimeout"] = module
+        self.assertIsNot(other, module)
+        # the state of the interpreter outlives the freed module
+        del other
+        gc.collect()
+        reloaded.set()
+        th.join()
+        self.assertEqual(fired, [True])
+
+    @unittest.skipIf(not hasattr(os, "fork"), "no fork")
+    def test_fork(self):
+        def on_timeout(start_time):
+            raise TimeoutError
+
+        def on_parent(start_time):
+            fired.append(start_time)
+
+        def thfunc():
+            with self.assertRaises(TimeoutError):
+                with xtimeout.check_context(20, on_timeout):
+                    busy(-1)
+
+        def parent_thread():
+            with xtimeout.check_context(200, on_parent):
+                busy(0.4)
+
+        fired = []
+        injector = xtimeout.Injector(200, on_parent)
+        injector.start()
+        th = threading.Thread(target=parent_thread)
+        th.start()
+        time.sleep(0.05)
+        with warnings.catch_warnings():
+            # forking a process with threads
+            warnings.simplefilter("ignore", DeprecationWarning)
+            pid = os.fork()
+        if pid == 0:
+            code = 1
+            try:
+                # the timers armed in the parent are dropped
+                busy(0.4)
+                injector.stop()
+                if not fired:
+                    thfunc()
+                    child = threading.Thread(target=thfunc)
+                    child.start()
+                    child.join()
+                    code = 0
+            finally:
+                os._exit(code)
+        th.join()
+        busy(0.2)
+        injector.stop()
+        self.wait_child(pid)
+        self.assertEqual(len(fired), 2)
+
+    @unittest.skipIf(not hasattr(os, "fork"), "no fork")
+    def test_fork_nested(self):
+        def on_timeout(start_time):
+            raise TimeoutError
+
+        with xtimeout.check_context(300, lambda start_time: None):
+            with warnings.catch_warnings():
+                warnings.simplefilter("ignore", DeprecationWarning)
+                pid = os.fork()
+            if pid == 0:
+                code = 1
+                try:
+                    # not covered by the guard the parent had armed
+                    with xtimeout.check_context(500, on_timeout):
+                        busy(1.5)
+                except TimeoutError:
+                    code = 0
+                finally:
+                    os._exit(code)
+        self.wait_child(pid)
+
+    def wait_child(self, pid):
+        end = time.time() + 10
+        while True:
+            done, status = os.waitpid(pid, os.WNOHANG)
+            if done or time.time() > end:
+                break
+            time.sleep(0.01)
+        if not done:
+            os.kill(pid, 9)
+            os.waitpid(pid, 0)
+            self.fail("the child hung")
+        self.assertTrue(os.WIFEXITED(status))
+        self.assertEqual(os.WEXITSTATUS(status), 0)
+
+    def test_stats(self):
+        def on_timeout(start_time):
+            pass
+
+        xtimeout.stats(reset=True)
+        for i in range(3):
+            with xtimeout.check_context(1, on_timeout):
+                busy(0.05)
+        for i in range(10):
+            with xtimeout.check_context(20, on_timeout):
+                pass
+        time.sleep(0.1)
+        values = xtimeout.stats(reset=True)
+        self.assertEqual(values["delivered"], 3)
+        self.assertGreaterEqual(values["expired"], 3)
+        self.assertGreaterEqual(values["cancelled"], 1)
+        self.assertGreater(values["lag_total_ns"], 0)
+        self.assertGreaterEqual(values["lag_max_ns"] * 3, values["lag_total_ns"])
+        self.assertGreater(values["checker_wakeups"], 0)
+        self.assertIn("timers", values)
+        self.assertEqual(xtimeout.stats()["delivered"], 0)
+
+    def run_async(self, coro):
+        loop = asyncio.new_event_loop()
+        try:
+            return loop.run_until_complete(coro)
+        finally:
+            loop.close()
+
+    def test_async_task_deadline(self):
+        def on_timeout(start_time):
+            raise TimeoutError
+
+        async def guarded(timeout, seconds):
+            async with xtimeout.check_context(timeout, on_timeout):
+                await asyncio.sleep(seconds)
+            return True
+
+        async def run():
+            # the short deadlines fire while the loop waits, only in their own task
+            tasks = [guarded(20, 0.5) if i % 2 else guarded(1000, 0.1) for i in range(200)]
+            return await asyncio.gather(*tasks, return_exceptions=True)
+
+        start = time.time()
+        results = self.run_async(run())
+        self.assertLess(time.time() - start, 0.4)
+        for i, res in enumerate(results):
+            if i % 2:
+                self.assertIsInstance(res, TimeoutError)
+            else:
+                self.assertIs(res, True)
+
+    def test_async_check_time(self):
+        called = []
+
+        @xtimeout.check_time(10, called.append)
+        async def slow():
+            await asyncio.sleep(0.1)
+            return 1
+
+        self.assertEqual(self.run_async(slow()), 1)
+        self.assertEqual(len(called), 1)
+
+    def test_async_hard(self):
+        called = []
+
+        async def guarded():
+            # the callback returns, the hard deadline still ends the task
+            async with xtimeout.check_context(10, called.append, hard=50):
+                await asyncio.sleep(1)
+
+        start = time.time()
+        with self.assertRaises(builtins.TimeoutError):
+            self.run_async(guarded())
+        self.assertLess(time.time() - start, 0.5)
+        self.assertEqual(len(called), 1)
+
+    def test_async_hard_exception(self):
+        class Expired(Exception):
+            pass
+
+        async def guarded():
+            async with xtimeout.check_context(10, None, hard=20, exception=Expired):
+                await asyncio.sleep(1)
+
+        with self.assertRaises(Expired):
+            self.run_async(guarded())
+
+    def test_async_inherit(self):
+        async def guarded():
+            async with xtimeout.check_context(10, lambda start_time: None, inherit=True):
+                pass
+
+        with self.assertRaises(TypeError):
+            self.run_async(guarded())
+
 
 if __name__ == "__main__":
     unittest.main()
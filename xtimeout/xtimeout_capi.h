@@ -0,0 +1,74 @@
+/*
+ * C API of _xtimeout for other extension modules, guards inner C loops with
+ * the same timers as Injector without creating Python objects
+ *
+ *     XTimeout_CAPI* api = XTimeout_Import();
+ *     XTimeoutTimer* timer = api->create(callback);
+ *     api->start(timer, 5000000);
+ *     ... inner loop, checking PyErr_CheckSignals() or api->remaining() ...
+ *     api->stop(timer);
+ *     api->destroy(timer);
+ */
+#ifndef XTIMEOUT_CAPI_H
+#define XTIMEOUT_CAPI_H
+
+#include <Python.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define XTIMEOUT_CAPI_NAME "_xtimeout._C_API"
+#define XTIMEOUT_CAPI_VERSION 1
+
+typedef struct XTimeoutTimer XTimeoutTimer;
+
+/* runs on a checker thread without the GIL, it must return quickly and must
+   not touch Python objects, e.g. set a flag the guarded loop polls */
+typedef void (*XTimeoutNativeCallback)(void* arg);
+
+typedef struct
+{
+    int version;
+
+    /* a timer of the calling thread, callback(start_time) runs on it at the
+       deadline like the callback of an Injector. requires the GIL, NULL with
+       an exception set on failure */
+    XTimeoutTimer* (*create)(PyObject* callback);
+
+    /* callback(arg) runs on the checker thread at the deadline. requires the GIL */
+    XTimeoutTimer* (*create_native)(XTimeoutNativeCallback callback, void* arg);
+
+    /* arm it for timeout_ns from now, a running arming is replaced. on the
+       creating thread, the GIL isn't needed */
+    void (*start)(XTimeoutTimer* timer, int64_t timeout_ns);
+
+    /* from any thread, the GIL isn't needed */
+    void (*stop)(XTimeoutTimer* timer);
+
+    /* stop and free it. requires the GIL */
+    void (*destroy)(XTimeoutTimer* timer);
+
+    /* nanoseconds left until the earliest deadline of the guards running on
+       the calling thread, negative once it passed, INT64_MAX without any */
+    int64_t (*remaining)(void);
+} XTimeout_CAPI;
+
+/* NULL with an exception set if _xtimeout can't be imported */
+static inline XTimeout_CAPI* XTimeout_Import(void)
+{
+    XTimeout_CAPI* api = (XTimeout_CAPI*)PyCapsule_Import(XTIMEOUT_CAPI_NAME, 0);
+    if (api != NULL && api->version < XTIMEOUT_CAPI_VERSION)
+    {
+        PyErr_SetString(PyExc_ImportError, "_xtimeout C API is too old");
+        return NULL;
+    }
+    return api;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* XTIMEOUT_CAPI_H */